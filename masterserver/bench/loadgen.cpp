@@ -0,0 +1,437 @@
+// loadgen.cpp : Open-loop synthetic load for the masterserver.
+//
+// Simulates game servers and players speaking the same packets as the game
+// and masterclient.cpp. Servers register with stser, answer the stlob and
+// pjoin the masterserver forwards with slack and pjack, and send lobup
+// every few seconds. Players send pslis, pllis, pjoin, pinvi and pquit at a
+// fixed total rate, whether or not earlier requests were answered, and
+// answer the pinvi sent to them with piack.
+//
+// Every request's latency is measured from when it was scheduled, not when
+// it was sent, so a masterserver that falls behind can't hide it. Replies
+// that name what they answer (slack, pjack, pqack, piack) are matched by
+// name; psack and plack name nothing and are matched to the oldest pslis
+// or pllis still waiting on the same socket. Anything not answered within
+// a second of the end counts as lost.
+//
+// With -f one more socket floods the masterserver with pslis at that rate
+// during the run, to see what one noisy source does to everyone else.
+//
+// Build: g++ -std=c++17 -O2 -pthread loadgen.cpp -o loadgen
+// Run:   loadgen [-a addr] [-p port] [-t threads] [-s servers] [-n players] [-g regions]
+//                [-r requests/s] [-d seconds] [-u lobup ms] [-k sockets per thread] [-f flood/s]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/resource.h>
+#include "../netio.h"
+#include "../metrics.h"
+using namespace std;
+
+#define STEAMID 76561197960000000ull // SteamID of player 0
+
+// what is measured, one for every request the simulation sends
+enum Flow { F_STSER, F_STLOB, F_PSLIS, F_PLLIS, F_PJOIN, F_PQUIT, F_PINVI, F_LOBUP, NFLOWS };
+const char* flownames[NFLOWS] = { "stser", "stlob", "pslis", "pllis", "pjoin", "pquit", "pinvi", "lobup" };
+
+struct Options {
+	string addr = "127.0.0.1";
+	int port = 8484;
+	int threads = 2;
+	int servers = 1000;
+	int players = 10000;
+	int regions = 8;
+	double rate = 20000;    // player requests per second, over all threads
+	int seconds = 10;
+	int lobupms = 5000;     // every server sends lobup this often
+	int sockets = 256;      // sockets the players of a thread share
+	double flood = 0;       // pslis per second from the one flooding socket
+};
+
+// what one thread measured
+struct FlowStats {
+	uint64_t sent = 0;
+	uint64_t answered = 0;
+	Histogram latency;      // ns from scheduled to answered
+};
+
+class Simulation {
+public:
+	Simulation(const Options& o, int id) : opt(o), id(id), rng(id * 7919 + 1) {
+		setaddr(master, opt.addr.c_str(), (unsigned short)opt.port);
+		ep = epoll_create1(0);
+		firstserver = opt.servers * id / opt.threads;
+		int nservers = opt.servers * (id + 1) / opt.threads - firstserver;
+		firstplayer = opt.players * id / opt.threads;
+		int nplayers = opt.players * (id + 1) / opt.threads - firstplayer;
+		for (int i = 0; i < nservers; ++i)
+			servers.push_back(opensocket(i));
+		for (int i = 0; i < opt.sockets && i < nplayers; ++i)
+			playersocks.push_back(opensocket(PLAYERBIT | i));
+		waiting.resize(playersocks.size() * 2);
+		lobbies.resize(nservers);
+		hosted.resize(nservers);
+		registered.assign(nplayers, false);
+	}
+	~Simulation() {
+		for (SOCKET s : servers)
+			closesocket(s);
+		for (SOCKET s : playersocks)
+			closesocket(s);
+		close(ep);
+	}
+
+	// registers every server and opens a lobby on each, returns false if the masterserver didn't answer
+	bool setup() {
+		auto deadline = netclock::now() + chrono::seconds(10);
+		// stser region
+		vector<bool> acked(servers.size(), false);
+		size_t left = servers.size();
+		while (left > 0 && netclock::now() < deadline) {
+			for (size_t i = 0; i < servers.size(); ++i) {
+				if (!acked[i])
+					request(servers[i], F_STSER, "stser " + regionof(i), "stser " + regionof(i) + "#" + to_string(i));
+			}
+			poll(netclock::now() + chrono::milliseconds(500));
+			left = 0;
+			for (size_t i = 0; i < servers.size(); ++i) {
+				acked[i] = acked[i] || pending.count("stser " + regionof(i) + "#" + to_string(i)) == 0;
+				left += !acked[i];
+			}
+		}
+		if (left > 0)
+			return false;
+		// stlob region:lobby, one lobby for every server
+		left = lobbies.size();
+		while (left > 0 && netclock::now() < deadline) {
+			for (size_t i = 0; i < lobbies.size(); ++i) {
+				if (lobbies[i].empty()) {
+					string key = regionof(i) + ":" + lobbyname(i);
+					request(playersocks[i % playersocks.size()], F_STLOB, "stlob " + key, "slack " + key);
+				}
+			}
+			poll(netclock::now() + chrono::milliseconds(500));
+			left = 0;
+			for (size_t i = 0; i < lobbies.size(); ++i) {
+				if (pending.count("slack " + regionof(i) + ":" + lobbyname(i)) == 0)
+					lobbies[i] = lobbyname(i);
+				left += lobbies[i].empty();
+			}
+		}
+		return left == 0;
+	}
+
+	// sends player requests at this thread's share of the rate until end, then waits a second for replies
+	void run(netclock::time_point start, netclock::time_point end) {
+		chrono::nanoseconds every((int64_t)(1e9 * opt.threads / opt.rate));
+		chrono::nanoseconds lobupevery = servers.empty() ? chrono::nanoseconds::max()
+			: chrono::nanoseconds((int64_t)opt.lobupms * 1000000 / (int64_t)servers.size());
+		netclock::time_point nextrequest = start, nextlobup = start;
+		size_t lobupserver = 0;
+		while (netclock::now() < end) {
+			netclock::time_point now = netclock::now();
+			for (; nextrequest <= now; nextrequest += every)
+				playerrequest(nextrequest);
+			for (; nextlobup <= now && !servers.empty(); nextlobup += lobupevery) {
+				size_t i = lobupserver++ % servers.size();
+				if (hosted[i].empty())
+					continue;
+				send(servers[i], "lobup " + hosted[i]);
+				stats[F_LOBUP].sent++;
+			}
+			poll(min(nextrequest, nextlobup));
+		}
+		poll(netclock::now() + chrono::seconds(1));
+	}
+
+	FlowStats stats[NFLOWS];
+
+private:
+	static const int PLAYERBIT = 1 << 30; // set in the epoll data of player sockets, servers' hold their index
+
+	SOCKET opensocket(int tag) {
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+		setnonblocking(s);
+		sockaddr_in any;
+		setaddr(any, "0.0.0.0", 0);
+		::bind(s, (sockaddr*)&any, sizeof(any));
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint32_t)tag;
+		epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+		return s;
+	}
+
+	string regionof(size_t server) const { return "R" + to_string((firstserver + server) % opt.regions); }
+	string lobbyname(size_t server) const { return "L" + to_string(firstserver + server); }
+	string playername(size_t p) const { return to_string(STEAMID + firstplayer + p); }
+	size_t socketof(size_t p) const { return p % playersocks.size(); }
+
+	void send(SOCKET s, const string& m) {
+		sendto(s, m.data(), m.size(), 0, (const sockaddr*)&master, sizeof(master));
+	}
+
+	// sends m and waits for the reply named key, latency counts from when
+	void request(SOCKET s, Flow f, const string& m, const string& key, netclock::time_point when = netclock::now()) {
+		send(s, m);
+		stats[f].sent++;
+		pending[key] = Pending{ f, when };
+	}
+
+	// one random player request scheduled at when
+	void playerrequest(netclock::time_point when) {
+		if (registered.empty())
+			return;
+		size_t p = rng() % registered.size();
+		string id = playername(p);
+		SOCKET s = playersocks[socketof(p)];
+		int kind = (int)(rng() % 100);
+		if (kind < 30 || !registered[p]) {
+			// pslis ID, psack names nothing so it waits in the socket's queue
+			send(s, "pslis " + id);
+			stats[F_PSLIS].sent++;
+			waiting[socketof(p) * 2].push_back(when);
+			registered[p] = true;
+		}
+		else if (kind < 55) {
+			send(s, "pllis R" + to_string(rng() % opt.regions));
+			stats[F_PLLIS].sent++;
+			waiting[socketof(p) * 2 + 1].push_back(when);
+		}
+		else if (kind < 75 && !lobbies.empty()) {
+			size_t l = rng() % lobbies.size();
+			if (pending.count("pjack " + id) == 0)
+				request(s, F_PJOIN, "pjoin " + id + ":" + regionof(l) + ":" + lobbies[l], "pjack " + id, when);
+		}
+		else if (kind < 85) {
+			if (pending.count("pqack " + id) == 0)
+				request(s, F_PQUIT, "pquit " + id, "pqack " + id, when);
+		}
+		else {
+			// invite another player of this thread, so this thread answers the invite
+			size_t q = rng() % registered.size();
+			string key = "piack " + id + ":" + playername(q);
+			if (q != p && registered[q] && pending.count(key) == 0)
+				request(s, F_PINVI, "pinvi " + id + ":" + playername(q), key, when);
+		}
+	}
+
+	// handles packets until deadline
+	void poll(netclock::time_point deadline) {
+		epoll_event events[64];
+		char buf[1100];
+		for (;;) {
+			auto left = chrono::duration_cast<chrono::milliseconds>(deadline - netclock::now()).count();
+			int n = epoll_wait(ep, events, 64, left > 0 ? (int)left : 0);
+			for (int i = 0; i < n; ++i) {
+				uint32_t tag = (uint32_t)events[i].data.u64;
+				bool player = (tag & PLAYERBIT) != 0;
+				size_t idx = tag & (PLAYERBIT - 1);
+				SOCKET s = player ? playersocks[idx] : servers[idx];
+				int len;
+				while ((len = (int)recv(s, buf, sizeof(buf) - 1, 0)) > 0) {
+					buf[len] = '\0';
+					if (player)
+						playerpacket(s, idx, string(buf, len));
+					else
+						serverpacket(s, idx, string(buf, len));
+				}
+			}
+			if (left <= 0)
+				return;
+		}
+	}
+
+	void answered(const string& key) {
+		auto it = pending.find(key);
+		if (it == pending.end())
+			return;
+		answered(it->second.flow, it->second.when);
+		pending.erase(it);
+	}
+	void answered(Flow f, netclock::time_point when) {
+		stats[f].answered++;
+		stats[f].latency.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(netclock::now() - when).count());
+	}
+
+	void serverpacket(SOCKET s, size_t idx, const string& m) {
+		string command = m.substr(0, 5), args = m.size() > 6 ? m.substr(6) : "";
+		if (command == "ssack")
+			answered("stser " + args + "#" + to_string(idx));
+		// the masterserver picked this server for a lobby, or is sending it a player
+		else if (command == "stlob") {
+			hosted[idx] = args;
+			send(s, "slack " + args);
+		}
+		else if (command == "pjoin")
+			send(s, "pjack " + args);
+	}
+
+	void playerpacket(SOCKET s, size_t idx, const string& m) {
+		string command = m.substr(0, 5), args = m.size() > 6 ? m.substr(6) : "";
+		if (command == "psack" || command == "plack") {
+			deque<netclock::time_point>& q = waiting[idx * 2 + (command == "plack")];
+			// replies that never came are counted lost, not matched to later ones
+			auto stale = netclock::now() - chrono::seconds(1);
+			while (q.size() > 1 && q.front() < stale)
+				q.pop_front();
+			if (!q.empty()) {
+				answered(command == "psack" ? F_PSLIS : F_PLLIS, q.front());
+				q.pop_front();
+			}
+		}
+		else if (command == "slack")
+			answered("slack " + args);
+		// pjack ID:serverIP:serverport
+		else if (command == "pjack")
+			answered("pjack " + args.substr(0, args.find(':')));
+		else if (command == "pqack")
+			answered("pqack " + args);
+		else if (command == "piack")
+			answered("piack " + args);
+		// an invite to one of this thread's players
+		else if (command == "pinvi")
+			send(s, "piack " + args);
+	}
+
+	struct Pending {
+		Flow flow;
+		netclock::time_point when;
+	};
+
+	const Options& opt;
+	int id;
+	mt19937_64 rng;
+	sockaddr_in master;
+	int ep;
+	int firstserver, firstplayer;
+	vector<SOCKET> servers;                       // one socket each, the masterserver tells servers apart by address
+	vector<SOCKET> playersocks;
+	vector<string> lobbies;                       // lobby opened for each server, empty until it was
+	vector<string> hosted;                        // region:lobby each server was given by stlob
+	vector<bool> registered;                      // players that sent pslis
+	unordered_map<string, Pending> pending;       // requests waiting for the reply named by the key
+	vector<deque<netclock::time_point>> waiting;  // pslis and pllis waiting on each player socket
+};
+
+static string micros(uint64_t ns) {
+	char text[32];
+	snprintf(text, sizeof(text), "%.1f", ns / 1000.0);
+	return text;
+}
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		string a = argv[i];
+		if (a == "-a") opt.addr = argv[i + 1];
+		else if (a == "-p") opt.port = atoi(argv[i + 1]);
+		else if (a == "-t") opt.threads = atoi(argv[i + 1]);
+		else if (a == "-s") opt.servers = atoi(argv[i + 1]);
+		else if (a == "-n") opt.players = atoi(argv[i + 1]);
+		else if (a == "-g") opt.regions = atoi(argv[i + 1]);
+		else if (a == "-r") opt.rate = atof(argv[i + 1]);
+		else if (a == "-d") opt.seconds = atoi(argv[i + 1]);
+		else if (a == "-u") opt.lobupms = atoi(argv[i + 1]);
+		else if (a == "-k") opt.sockets = atoi(argv[i + 1]);
+		else if (a == "-f") opt.flood = atof(argv[i + 1]);
+	}
+	if (opt.threads < 1 || opt.players < opt.threads || opt.regions < 1 || opt.rate <= 0 || opt.sockets < 1) {
+		printf("usage: loadgen [-a addr] [-p port] [-t threads] [-s servers] [-n players] [-g regions]\n"
+			"               [-r requests/s] [-d seconds] [-u lobup ms] [-k sockets per thread] [-f flood/s]\n");
+		return 1;
+	}
+	// a socket for every server
+	rlimit files;
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	printf("%d threads, %d servers, %d players in %d regions, %.0f requests/s for %ds against %s:%d\n",
+		opt.threads, opt.servers, opt.players, opt.regions, opt.rate, opt.seconds, opt.addr.c_str(), opt.port);
+	fflush(stdout);
+
+	vector<unique_ptr<Simulation>> sims;
+	for (int t = 0; t < opt.threads; ++t)
+		sims.emplace_back(new Simulation(opt, t));
+	atomic<int> failed(0);
+	vector<thread> threads;
+	for (auto& sim : sims)
+		threads.emplace_back([&sim, &failed]() { if (!sim->setup()) ++failed; });
+	for (auto& t : threads)
+		t.join();
+	if (failed > 0) {
+		printf("masterserver did not answer the setup of %d threads\n", failed.load());
+		return 1;
+	}
+
+	netclock::time_point start = netclock::now() + chrono::milliseconds(100);
+	netclock::time_point end = start + chrono::seconds(opt.seconds);
+	threads.clear();
+	for (auto& sim : sims)
+		threads.emplace_back([&sim, start, end]() { sim->run(start, end); });
+	// the flood, answers are read only to keep the socket's buffer from filling
+	uint64_t flooded = 0, floodanswered = 0;
+	if (opt.flood > 0) {
+		threads.emplace_back([&opt, &flooded, &floodanswered, start, end]() {
+			SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+			setnonblocking(s);
+			sockaddr_in master;
+			setaddr(master, opt.addr.c_str(), (unsigned short)opt.port);
+			const char msg[] = "pslis 76561197969999999";
+			chrono::nanoseconds every((int64_t)(1e9 / opt.flood));
+			char buf[2048];
+			for (netclock::time_point next = start; netclock::now() < end; ) {
+				for (netclock::time_point now = netclock::now(); next <= now; next += every, ++flooded)
+					sendto(s, msg, sizeof(msg) - 1, 0, (const sockaddr*)&master, sizeof(master));
+				while (recv(s, buf, sizeof(buf), 0) > 0)
+					++floodanswered;
+				this_thread::sleep_until(next);
+			}
+			closesocket(s);
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	printf("flow          sent   answered    loss%%    req/s      p50 us      p99 us     p999 us      max us\n");
+	uint64_t total = 0;
+	for (int f = 0; f < NFLOWS; ++f) {
+		uint64_t sent = 0, answered = 0;
+		HistogramSum latency;
+		for (auto& sim : sims) {
+			sent += sim->stats[f].sent;
+			answered += sim->stats[f].answered;
+			latency.add(sim->stats[f].latency);
+		}
+		// lobup has no reply, the setup flows aren't part of the timed run
+		if (f == F_LOBUP) {
+			printf("%-6s %11llu          -        -  %7.0f\n", flownames[f], (unsigned long long)sent, (double)sent / opt.seconds);
+			continue;
+		}
+		double loss = sent == 0 ? 0 : 100.0 * (double)(sent - min(sent, answered)) / (double)sent;
+		double rate = f == F_STSER || f == F_STLOB ? 0 : (double)answered / opt.seconds;
+		printf("%-6s %11llu %10llu %8.2f  %7.0f  %10s  %10s  %10s  %10s\n", flownames[f],
+			(unsigned long long)sent, (unsigned long long)answered, loss, rate,
+			micros(latency.quantile(0.5)).c_str(), micros(latency.quantile(0.99)).c_str(),
+			micros(latency.quantile(0.999)).c_str(), micros(latency.max()).c_str());
+		if (f != F_STSER && f != F_STLOB)
+			total += answered;
+	}
+	printf("throughput %.0f answered requests/s\n", (double)total / opt.seconds);
+	if (opt.flood > 0)
+		printf("flood sent %llu answered %llu\n", (unsigned long long)flooded, (unsigned long long)floodanswered);
+	return 0;
+}
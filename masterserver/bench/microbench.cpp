@@ -0,0 +1,733 @@
+// microbench.cpp : Times the masterserver's parsing, handlers, retransmission
+// and reply building on their own, without sockets.
+//
+// It includes masterserver.cpp with MASTERSERVER_NO_MAIN and points transmit
+// at a function that only remembers the last packet, so a handler costs what
+// it does inside the masterserver minus the sendto(). The registry is filled
+// through the handlers themselves, as servers and players would, at every
+// size from 10 up to -m lobbies and players.
+//
+// Every result is one JSON object per line, e.g.
+//   {"bench":"handler","case":"pjoin-pjack-pquit","size":1000,"ns":412.3,"ops":300000}
+// where ns is the time per packet (or per operation for the other benches),
+// so two builds can be compared by joining their lines on bench, case and size.
+//
+// The restart bench has the handlers journal the registry they fill, then
+// times replaying that log, building a snapshot and replaying the snapshot
+// per record, as a masterserver started with -d does, and the longest a
+// worker stops for one step of building a snapshot. Every replay must give
+// back the registry that was logged, record for record, or the bench exits
+// with an error: once from the log alone, once from a snapshot, and once
+// from a snapshot built a step at a time while players join and quit and
+// lobbies open and close between its steps, with the log after it.
+//
+// The lookup bench compares finding the players of a friend list one at a
+// time with findplayers(), which prefetches the whole list first.
+//
+// Build: g++ -std=c++17 -O2 -pthread microbench.cpp -o microbench
+// Run:   microbench [-m maxsize] [-n packets per case]
+
+#define MASTERSERVER_NO_MAIN
+#include "../masterserver.cpp"
+
+// the last packet a handler sent, and where
+static string lastpacket;
+static sockaddr_in lastto;
+static uint64_t transmitted = 0;
+// every packet sent while keepsent is set, for handlers that send several
+static bool keepsent = false;
+static vector<pair<string, sockaddr_in>> sent;
+
+static int capture(const char* data, int len, const sockaddr_in& to) {
+	lastpacket.assign(data, len);
+	lastto = to;
+	++transmitted;
+	if (keepsent)
+		sent.push_back(make_pair(lastpacket, to));
+	return len;
+}
+
+static void result(const char* bench, const string& name, size_t size, double ns, uint64_t ops) {
+	printf("{\"bench\":\"%s\",\"case\":\"%s\",\"size\":%zu,\"ns\":%.1f,\"ops\":%llu}\n",
+		bench, name.c_str(), size, ns, (unsigned long long)ops);
+	fflush(stdout);
+}
+
+// address of the k-th simulated server or player
+static sockaddr_in serveraddr(size_t k) {
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(0x0A000000u + (uint32_t)(k / 50000));
+	a.sin_port = htons((unsigned short)(10000 + k % 50000));
+	return a;
+}
+// k of serveraddr(k)
+static size_t serverindex(const sockaddr_in& a) {
+	return (size_t)(ntohl(a.sin_addr.s_addr) - 0x0A000000u) * 50000 + (ntohs(a.sin_port) - 10000);
+}
+static sockaddr_in playeraddr(size_t k) {
+	sockaddr_in a = serveraddr(k);
+	a.sin_addr.s_addr = htonl(0x0B000000u + (uint32_t)(k / 50000));
+	return a;
+}
+
+static void deliver(const string& m, const sockaddr_in& from) {
+	handlepacket(m.data(), (int)m.size(), from, false);
+}
+
+static string regionname(size_t k, size_t regions) { return "R" + to_string(k % regions); }
+static string lobbyname(size_t k) { return "L" + to_string(k); }
+static string playername(size_t k) { return to_string(76561197960000000ull + k); }
+
+static void reset() {
+	unackedPackets.clear();
+	unackedTimers.clear();
+	registry.clear();
+	publishregions();
+}
+
+// n servers, each hosting one lobby, 100 lobbies to a region, and n players
+static size_t populate(size_t n) {
+	reset();
+	size_t regions = n / 100 > 0 ? n / 100 : 1;
+	for (size_t k = 0; k < n; ++k) {
+		string region = regionname(k, regions);
+		deliver("stser " + region, serveraddr(k));
+		deliver("stlob " + region + ":" + lobbyname(k), playeraddr(k));
+		// the open server the masterserver picked answers
+		deliver("slack " + lastpacket.substr(ARGSTART), lastto);
+		deliver("pslis " + playername(k), playeraddr(k));
+	}
+	return regions;
+}
+
+// runs one case: cycle(i) sends the packets of its i-th run, packets of them each time
+template <typename F>
+static void timecase(const char* bench, const string& name, size_t size, uint64_t total, int packets, F cycle) {
+	uint64_t runs = total / packets > 0 ? total / packets : 1;
+	for (uint64_t i = 0; i < runs / 10; ++i)
+		cycle(i);
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < runs; ++i)
+		cycle(i);
+	double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+	result(bench, name, size, ns / (double)(runs * packets), runs * packets);
+}
+
+static void parsebench(uint64_t total) {
+	static const char* packets[] = {
+		"stser US",
+		"pslis 76561197960287930",
+		"pllis US",
+		"pjoin 76561197960287930:US:lobby1",
+		"pjack 76561197960287930:192.168.1.20:50123:US:lobby1",
+		"pinvi 76561197960287930:76561197960287931",
+		"piack 76561197960287930:76561197960287931:US:lobby1",
+		"lobup US:lobby1:76561197960287930:76561197960287931",
+	};
+	const int n = sizeof(packets) / sizeof(packets[0]);
+	size_t lens[n];
+	for (int i = 0; i < n; ++i)
+		lens[i] = strlen(packets[i]);
+	volatile size_t sink = 0;
+	timecase("parse", "parserequest+dispatch", n, total, n, [&](uint64_t) {
+		for (int i = 0; i < n; ++i) {
+			Request r;
+			parserequest(packets[i], lens[i], r);
+			sink = sink + dispatch.slot(r.code) + r.nfields;
+		}
+	});
+}
+
+static void handlerbench(size_t n, uint64_t total) {
+	size_t regions = populate(n);
+
+	timecase("handler", "pslis", n, total, 1, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		deliver("pslis " + playername(k), playeraddr(k));
+	});
+	timecase("handler", "pllis", n, total, 1, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		deliver("pllis " + regionname(k, regions), playeraddr(k));
+	});
+	timecase("handler", "pllis paged", n, total, 1, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		deliver("pllis " + regionname(k, regions) + ":0:0", playeraddr(k));
+	});
+	timecase("handler", "lobup", n, total, 1, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		deliver("lobup " + regionname(k, regions) + ":" + lobbyname(k), serveraddr(k));
+	});
+	// a server that already hosts a lobby registering again
+	timecase("handler", "stser redundant", n, total, 1, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		deliver("stser " + regionname(k, regions), serveraddr(k));
+	});
+	timecase("handler", "unknown", n, total, 1, [&](uint64_t) {
+		deliver("bogus x", playeraddr(0));
+	});
+	// a new server opens a lobby and closes it again, leaving the registry as it was
+	timecase("handler", "stser-stlob-slack-close", n, total, 4, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		string region = regionname(k, regions);
+		sockaddr_in server = serveraddr(n + i % 1000);
+		deliver("stser " + region, server);
+		deliver("stlob " + region + ":X" + to_string(i), playeraddr(k));
+		deliver("slack " + lastpacket.substr(ARGSTART), lastto);
+		deliver("close " + region + ":X" + to_string(i), server);
+	});
+	// a player joins the lobby of another and quits again
+	timecase("handler", "pjoin-pjack-pquit", n, total, 3, [&](uint64_t i) {
+		size_t k = (i * 7919) % n, l = (i * 104729 + 1) % n;
+		deliver("pjoin " + playername(k) + ":" + regionname(l, regions) + ":" + lobbyname(l), playeraddr(k));
+		deliver("pjack " + lastpacket.substr(ARGSTART), lastto);
+		deliver("pquit " + playername(k), playeraddr(k));
+	});
+	// a player is quick matched into the fullest lobby of a region and quits again
+	timecase("handler", "pquik-pjack-pquit", n, total, 3, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		deliver("pquik " + playername(k) + ":" + regionname(i, regions), playeraddr(k));
+		deliver("pjack " + lastpacket.substr(ARGSTART), lastto);
+		deliver("pquit " + playername(k), playeraddr(k));
+	});
+	// a player invites another, who ACKs
+	timecase("handler", "pinvi-piack", n, total, 2, [&](uint64_t i) {
+		size_t k = (i * 7919) % n, q = (i * 104729 + 1) % n;
+		if (q == k)
+			q = (q + 1) % n;
+		deliver("pinvi " + playername(k) + ":" + playername(q), playeraddr(k));
+		deliver("piack " + lastpacket.substr(ARGSTART), lastto);
+	});
+	// a player invites a party of 8 who all ACK, one pinvi each or one pinvm, time per invitee
+	auto party = [&](bool batched) {
+		return [&, batched](uint64_t i) {
+			size_t k = (i * 7919) % n;
+			string pinvm = "pinvm " + playername(k);
+			keepsent = true;
+			for (size_t j = 1; j <= 8; ++j) {
+				string q = playername((k + j * 104729) % n);
+				if (batched)
+					pinvm += ":" + q;
+				else
+					deliver("pinvi " + playername(k) + ":" + q, playeraddr(k));
+			}
+			if (batched)
+				deliver(pinvm, playeraddr(k));
+			keepsent = false;
+			for (auto& s : sent) {
+				if (s.first.compare(0, CMDLEN, "pinvi") == 0)
+					deliver("piack " + s.first.substr(ARGSTART), s.second);
+			}
+			sent.clear();
+		};
+	};
+	timecase("handler", "party of 8 pinvi-piack", n, total, 8, party(false));
+	timecase("handler", "party of 8 pinvm-piack", n, total, 8, party(true));
+
+	// a player asks for the presence of 50 friends, time per friend, and the lookups it makes
+	// one SteamID at a time or in one batch
+	vector<string> friends;
+	auto friendsof = [&](size_t k) {
+		friends.clear();
+		for (size_t j = 1; j <= 50; ++j)
+			friends.push_back(playername((k + j * 104729) % n));
+	};
+	timecase("handler", "ppres of 50", n, total, 50, [&](uint64_t i) {
+		size_t k = (i * 7919) % n;
+		friendsof(k);
+		string ppres = "ppres " + playername(k);
+		for (const string& f : friends)
+			ppres += ":" + f;
+		deliver(ppres, playeraddr(k));
+	});
+	string_view views[50];
+	uint32_t ids[50];
+	volatile uint32_t sink = 0;
+	timecase("lookup", "findplayer x50", n, total, 50, [&](uint64_t i) {
+		friendsof((i * 7919) % n);
+		for (int j = 0; j < 50; ++j)
+			sink = sink + registry.findplayer(friends[j]);
+	});
+	timecase("lookup", "findplayers x50", n, total, 50, [&](uint64_t i) {
+		friendsof((i * 7919) % n);
+		for (int j = 0; j < 50; ++j)
+			views[j] = friends[j];
+		registry.findplayers(views, 50, ids);
+		for (int j = 0; j < 50; ++j)
+			sink = sink + ids[j];
+	});
+}
+
+static void retransmitbench(size_t n) {
+	reset();
+	sockaddr_in to = playeraddr(0);
+	vector<string> args;
+	for (size_t i = 0; i < n; ++i)
+		args.push_back(playername(i) + ":" + playername(i + 1));
+	// every packet saved a whole RTO ago, so all of them are due
+	auto save = [&](netclock::time_point when) {
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < n; ++i) {
+			Packet p;
+			p.command = "pinvi";
+			p.arguments = args[i];
+			p.from = makeendpoint(to);
+			p.to = p.from;
+			p.timestamp = when;
+			saveunACKed(p);
+		}
+		return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n;
+	};
+	result("retransmit", "saveunACKed", n, save(netclock::now()), n);
+
+	// nothing due yet
+	uint64_t calls = 100000;
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < calls; ++i)
+		retransmitunACKed();
+	result("retransmit", "retransmitunACKed idle", n,
+		chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls, calls);
+
+	start = chrono::steady_clock::now();
+	volatile int found = 0;
+	for (size_t i = 0; i < n; ++i)
+		found = found + unackedPackets.find("pinvi", args[i]);
+	result("retransmit", "find", n, chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n, n);
+
+	// all due
+	unackedPackets.clear();
+	unackedTimers.clear();
+	save(netclock::now() - RTO - chrono::milliseconds(1));
+	uint64_t before = transmitted;
+	start = chrono::steady_clock::now();
+	retransmitunACKed();
+	uint64_t sent = transmitted - before;
+	result("retransmit", "retransmitunACKed due", n,
+		chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (sent ? sent : 1), sent);
+
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < n; ++i) {
+		int slot = unackedPackets.find("pinvi", args[i]);
+		if (slot >= 0)
+			ackunACKed(slot);
+	}
+	result("retransmit", "ackunACKed", n, chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n, n);
+}
+
+// datagrams over loopback, received and sent batch at a time as the workers do, per datagram
+static void batchbench(int batch) {
+	SOCKET rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in a;
+	setaddr(a, "127.0.0.1", 0);
+	socklen_t alen = sizeof(a);
+	int size = 4 << 20;
+	setsockopt(rx, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+	if (::bind(rx, (sockaddr*)&a, sizeof(a)) != 0 || getsockname(rx, (sockaddr*)&a, &alen) != 0)
+		return;
+	setnonblocking(rx);
+	RecvBatch in;
+	SendBatch out;
+	const char msg[] = "pslis 76561197960000000";
+	const int rounds = 250, perround = 1024;
+	double recvns = 0, sendns = 0;
+	uint64_t moved = 0;
+	for (int r = 0; r < rounds; ++r) {
+		auto start = chrono::steady_clock::now();
+		int err;
+		for (int i = 0; i < perround; ++i) {
+			out.queue(msg, sizeof(msg) - 1, a);
+			if (out.pending() == batch)
+				out.flush(tx, err);
+		}
+		out.flush(tx, err);
+		auto sent = chrono::steady_clock::now();
+		int n;
+		while ((n = in.receive(rx, batch)) > 0)
+			moved += (uint64_t)n;
+		sendns += chrono::duration<double, nano>(sent - start).count();
+		recvns += chrono::duration<double, nano>(chrono::steady_clock::now() - sent).count();
+	}
+	uint64_t total = (uint64_t)rounds * perround;
+	result("netio", "sendmmsg", (size_t)batch, sendns / (double)total, total);
+	result("netio", "recvmmsg", (size_t)batch, recvns / (double)(moved ? moved : 1), moved);
+	closesocket(rx);
+	closesocket(tx);
+}
+
+// n players relayed to n / 8 servers over loopback, each sending a datagram a round as at
+// 60 Hz: the relay thread's CPU time per datagram relayed, and the time one datagram alone
+// takes from player to server through it
+static void relaybench(size_t n) {
+	static unsigned short firstport = 39000;
+	Inbox* inbox = new Inbox();
+	Inbox* answers = new Inbox();
+	RelayMetrics* m = new RelayMetrics();
+	Relay* relay = new Relay();
+	while (!relay->open(firstport, inbox, answers, m, MAXBATCH)) {
+		relay->close();
+		firstport += RELAYPORTS;
+	}
+	firstport += RELAYPORTS;
+	// the relay runs until the bench ends
+	thread runner([relay] { relay->run(); });
+	clockid_t cpu;
+	if (pthread_getcpuclockid(runner.native_handle(), &cpu) != 0)
+		exit(EXIT_FAILURE);
+	runner.detach();
+	auto cputime = [cpu]() {
+		timespec ts;
+		clock_gettime(cpu, &ts);
+		return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+	};
+
+	auto bound = [](sockaddr_in& a) {
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+		setaddr(a, "127.0.0.1", 0);
+		socklen_t alen = sizeof(a);
+		int size = 4 << 20;
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+		if (::bind(s, (sockaddr*)&a, sizeof(a)) != 0 || getsockname(s, (sockaddr*)&a, &alen) != 0)
+			exit(EXIT_FAILURE);
+		timeval tv = { 1, 0 };
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+		return s;
+	};
+	size_t nservers = (n + 7) / 8;
+	vector<SOCKET> players(n), servers(nservers);
+	vector<sockaddr_in> playeraddrs(n), serveraddrs(nservers), relayed(n);
+	for (size_t k = 0; k < nservers; ++k)
+		servers[k] = bound(serveraddrs[k]);
+	char buf[RELAYLEN];
+	for (size_t k = 0; k < n; ++k) {
+		players[k] = bound(playeraddrs[k]);
+		Reply t("xrely");
+		t.field(playername(k)).field("R0").field(lobbyname(k / 8)).field(makeendpoint(serveraddrs[k / 8]).str());
+		while (!inbox->push(playeraddrs[k], t.data(), t.size(), true))
+			this_thread::yield();
+		// the session's port and tokens come back as the worker would get them, then both
+		// ends say hello to it
+		ShardMessage a;
+		while (!answers->pop(a))
+			this_thread::yield();
+		Request r;
+		parserequest(a.data, a.len, r);
+		setaddr(relayed[k], "127.0.0.1", (unsigned short)fieldnumber(r.field(3)));
+		string hello = "rhelo " + string(r.field(5));
+		sendto(servers[k / 8], hello.data(), hello.size(), 0, (const sockaddr*)&relayed[k], sizeof(relayed[k]));
+		hello = "rhelo " + string(r.field(4));
+		sendto(players[k], hello.data(), hello.size(), 0, (const sockaddr*)&relayed[k], sizeof(relayed[k]));
+		if (recv(servers[k / 8], buf, sizeof(buf), 0) <= 0 || recv(players[k], buf, sizeof(buf), 0) <= 0)
+			exit(EXIT_FAILURE);
+	}
+
+	// every player sends its snapshot, then the servers take them
+	const int rounds = 200;
+	char payload[200];
+	memset(payload, 'x', sizeof(payload));
+	uint64_t before = m->packets.get();
+	double cpustart = cputime();
+	for (int r = 0; r < rounds; ++r) {
+		for (size_t k = 0; k < n; ++k)
+			sendto(players[k], payload, sizeof(payload), 0, (const sockaddr*)&relayed[k], sizeof(relayed[k]));
+		for (size_t k = 0; k < n; ++k)
+			recv(servers[k / 8], buf, sizeof(buf), 0);
+	}
+	uint64_t moved = m->packets.get() - before;
+	result("relay", "cpu per datagram", n, (cputime() - cpustart) / (double)(moved ? moved : 1), moved);
+
+	// one datagram at a time
+	vector<double> times;
+	for (int r = 0; r < 2000; ++r) {
+		size_t k = (size_t)r % n;
+		auto sent = chrono::steady_clock::now();
+		sendto(players[k], payload, sizeof(payload), 0, (const sockaddr*)&relayed[k], sizeof(relayed[k]));
+		if (recv(servers[k / 8], buf, sizeof(buf), 0) > 0)
+			times.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - sent).count());
+	}
+	sort(times.begin(), times.end());
+	if (!times.empty()) {
+		result("relay", "one-way p50", n, times[times.size() / 2], times.size());
+		result("relay", "one-way p99", n, times[times.size() * 99 / 100], times.size());
+	}
+	for (SOCKET s : players)
+		closesocket(s);
+	for (SOCKET s : servers)
+		closesocket(s);
+}
+
+// n players subscribed to a region of 100 lobbies that a player joins and quits, per push sent
+static void subscribebench(size_t n, uint64_t total) {
+	populate(100);
+	for (size_t k = 0; k < n; ++k)
+		deliver("psubs R0:0", playeraddr(1000 + k));
+	uint64_t before = metrics[0]->pushes.get();
+	auto start = chrono::steady_clock::now();
+	uint64_t cycles = total / (n + 1) > 10 ? total / (n + 1) : 10;
+	for (uint64_t i = 0; i < cycles; ++i) {
+		deliver("pjoin " + playername(0) + ":R0:" + lobbyname(0), playeraddr(0));
+		deliver("pjack " + lastpacket.substr(ARGSTART), lastto);
+		deliver("pquit " + playername(0), playeraddr(0));
+		pushchanges();
+	}
+	uint64_t pushes = metrics[0]->pushes.get() - before;
+	result("subscribe", "pjoin-pjack-pquit push", n,
+		chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (double)(pushes ? pushes : 1), pushes);
+	subscribers.clear();
+	registry.recordchanges(false);
+}
+
+// n open servers of one region, four to a host, each lobby placed on the least loaded host
+static void placementbench(size_t n, uint64_t total) {
+	reset();
+	auto stser = [&](size_t k, uint64_t i) {
+		// the host's load changes with every report
+		string load = to_string((k * 31 + i) % 100) + ":" + to_string((k * 7919 + i) % 20000) + ":" + to_string(i % 8);
+		deliver("stser R0:h" + to_string(k / 4) + ":" + load, serveraddr(k));
+	};
+	for (size_t k = 0; k < n; ++k)
+		stser(k, 0);
+	// the placed server hosts a lobby that closes, and registers again with its host's new load
+	timecase("placement", "stlob-slack-close-stser", n, total, 4, [&](uint64_t i) {
+		deliver("stlob R0:X" + to_string(i), playeraddr(0));
+		sockaddr_in server = lastto;
+		deliver("slack " + lastpacket.substr(ARGSTART), server);
+		deliver("close R0:X" + to_string(i), server);
+		stser(serverindex(server), i);
+	});
+}
+
+// n lobbies of one region with 4 modes and 16 maps, a quarter of them full, searched through
+// the lists of a mode and map, and by attributes that have none so every lobby is looked at
+static void searchbench(size_t n, uint64_t total) {
+	reset();
+	static const char* modes[] = { "dm", "tdm", "ctf", "koth" };
+	for (size_t k = 0; k < n; ++k) {
+		string lname = lobbyname(k);
+		deliver("stser R0", serveraddr(k));
+		deliver("stlob R0:" + lname, playeraddr(k));
+		sockaddr_in server = lastto;
+		deliver("slack R0:" + lname + ":" + to_string(1 + k % 4), server);
+		deliver("lbinf R0:" + lname + ":" + modes[k / 3 % 4] + ":m" + to_string(k / 7 % 16) + ":" + (k % 10 == 0 ? "1" : "0")
+			+ ":" + to_string(1 + k / 64 % 2), server);
+		if (k % 2 == 0) {
+			deliver("pslis " + playername(k), playeraddr(k));
+			deliver("pjoin " + playername(k) + ":R0:" + lname, playeraddr(k));
+			deliver("pjack " + lastpacket.substr(ARGSTART), lastto);
+		}
+	}
+	timecase("search", "pfind mode map free", n, total, 1, [&](uint64_t i) {
+		deliver("pfind R0:mode=dm:map=m" + to_string(i % 16) + ":free", playeraddr(0));
+	});
+	timecase("search", "pfind mode map free sort", n, total, 1, [&](uint64_t i) {
+		deliver("pfind R0:mode=dm:map=m" + to_string(i % 16) + ":free:sort=players", playeraddr(0));
+	});
+	timecase("search", "pfind unindexed", n, total / 10, 1, [&](uint64_t i) {
+		deliver("pfind R0:pass=0:ver=" + to_string(1 + i % 2), playeraddr(0));
+	});
+}
+
+// n lobbies and n players outside them, first with nobody due, then with everybody dead
+static void expirybench(size_t n) {
+	registry.setlifetimes(chrono::seconds(1), chrono::seconds(1));
+	populate(n);
+	uint64_t calls = 100000;
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < calls; ++i)
+		expireDead();
+	result("expiry", "expireDead idle", n,
+		chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls, calls);
+
+	// past both lifetimes and the wheel's tick
+	this_thread::sleep_for(chrono::milliseconds(2100));
+	WorkerMetrics& m = *metrics[0];
+	uint64_t before = m.expiredlobbies.get() + m.expiredplayers.get();
+	start = chrono::steady_clock::now();
+	expireDead();
+	uint64_t dead = m.expiredlobbies.get() + m.expiredplayers.get() - before;
+	result("expiry", "expireDead due", n,
+		chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (dead ? dead : 1), dead);
+	registry.setlifetimes(serverLife, playerLife);
+}
+
+// psack and plack built again every time, as after a stser or slack changed them
+static void replybench(size_t n, uint64_t total) {
+	// n regions for psack
+	reset();
+	for (size_t k = 0; k < n; ++k)
+		deliver("stser " + regionname(k, n), serveraddr(k));
+	timecase("reply", "psack build", n, total, 1, [&](uint64_t i) {
+		regionsversion.fetch_add(1);
+		deliver("pslis " + playername(i % 1000), playeraddr(i % 1000));
+	});
+	timecase("reply", "pspag build", n, total, 1, [&](uint64_t i) {
+		regionsversion.fetch_add(1);
+		deliver("pslis " + playername(i % 1000) + ":0:0", playeraddr(i % 1000));
+	});
+
+	// n lobbies in one region for plack
+	reset();
+	for (size_t k = 0; k < n; ++k) {
+		deliver("stser R", serveraddr(k));
+		deliver("stlob R:" + lobbyname(k), playeraddr(k));
+		deliver("slack " + lastpacket.substr(ARGSTART), lastto);
+	}
+	uint32_t rg = registry.listedregion("R");
+	timecase("reply", "plack build", n, total, 1, [&](uint64_t i) {
+		registry.lobbylist(rg).clear();
+		deliver("pllis R", playeraddr(i % 1000));
+	});
+	timecase("reply", "plpag build", n, total, 1, [&](uint64_t i) {
+		registry.lobbypages(rg).clear();
+		deliver("pllis R:0:0", playeraddr(i % 1000));
+	});
+}
+
+// the records a snapshot of reg holds, in order, to compare registries whose slots differ
+static vector<string> recordsof(const Registry& reg) {
+	string body;
+	snapshotof(reg, body);
+	vector<string> records;
+	const char* p = body.data();
+	const char* end = p + body.size();
+	JournalRecord rec;
+	for (const char* q = p; nextrecord(p, end, rec); q = p)
+		records.emplace_back(q, p);
+	sort(records.begin(), records.end());
+	return records;
+}
+
+// the registry of n lobbies and players logged by the handlers, snapshotted, and read back from each
+static void restartbench(size_t n) {
+	char dir[] = "/tmp/microbenchXXXXXX";
+	if (mkdtemp(dir) == NULL)
+		return;
+	vector<JournalFile> files;
+	journal.open(dir, 0, 1, 1);
+	size_t regions = populate(n);
+	// every player in someone's lobby
+	for (size_t k = 0; k < n; ++k) {
+		size_t l = (k * 7919) % n;
+		deliver("pjoin " + playername(k) + ":" + regionname(l, regions) + ":" + lobbyname(l), playeraddr(k));
+		deliver("pjack " + lastpacket.substr(ARGSTART), lastto);
+	}
+	journal.flush();
+
+	// what a restart reads back must be the registry that was logged
+	auto replay = [&](const char* name) {
+		listjournals(dir, files);
+		Registry back;
+		auto start = chrono::steady_clock::now();
+		size_t records = replayjournals(files, 0, 1, false, back);
+		double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+		result("restart", name, n, ns / (double)(records ? records : 1), records);
+		if (recordsof(back) != recordsof(registry)) {
+			fprintf(stderr, "restart %s of %zu: the registry read back differs from the one logged\n", name, n);
+			exit(EXIT_FAILURE);
+		}
+	};
+	replay("replay log");
+
+	string body;
+	auto start = chrono::steady_clock::now();
+	snapshotof(registry, body);
+	double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+	result("restart", "snapshot build", n, ns / (double)n, n);
+	// the longest the worker stops for one loop turn's step of the build, the writing is up to
+	// the writer thread
+	double longest = 0;
+	int steps = 0;
+	journal.snapshot(registry, false);
+	while (journal.busy()) {
+		start = chrono::steady_clock::now();
+		journal.step(registry);
+		ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+		longest = max(longest, ns);
+		++steps;
+	}
+	result("restart", "snapshot stall", n, longest, steps);
+	journal.close();
+	replay("replay snapshot");
+
+	// a snapshot built a step at a time while the registry changes between its steps, as the
+	// worker keeps handling packets, and the changes logged after it
+	uint64_t gen = 0;
+	for (const JournalFile& f : files)
+		gen = max(gen, f.header.generation);
+	journal.open(dir, 0, 1, gen + 1);
+	uint64_t i = 0;
+	auto churn = [&]() {
+		for (int j = 0; j < 50; ++j, ++i) {
+			size_t k = (i * 7919 + 13) % n, l = (i * 104729 + 7) % n;
+			string region = regionname(l, regions);
+			switch (i % 4) {
+			case 0:
+				deliver("pjoin " + playername(k) + ":" + region + ":" + lobbyname(l), playeraddr(k));
+				deliver("pjack " + lastpacket.substr(ARGSTART), lastto);
+				break;
+			case 1:
+				deliver("pquit " + playername(k), playeraddr(k));
+				break;
+			case 2:
+				deliver("close " + region + ":" + lobbyname(l), serveraddr(l));
+				break;
+			default:
+				deliver("stser " + region, serveraddr(n + i));
+				deliver("stlob " + region + ":X" + to_string(i), playeraddr(k));
+				deliver("slack " + lastpacket.substr(ARGSTART), lastto);
+				break;
+			}
+		}
+	};
+	journal.snapshot(registry, false);
+	while (journal.busy()) {
+		churn();
+		journal.step(registry);
+	}
+	churn();
+	journal.close();
+	replay("replay snapshot under changes");
+
+	listjournals(dir, files);
+	for (const JournalFile& f : files)
+		unlink(f.path.c_str());
+	rmdir(dir);
+}
+
+int main(int argc, char* argv[]) {
+	size_t maxsize = 1000000;
+	uint64_t total = 200000;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		string a = argv[i];
+		if (a == "-m") maxsize = strtoull(argv[i + 1], NULL, 10);
+		else if (a == "-n") total = strtoull(argv[i + 1], NULL, 10);
+	}
+	logger().setlevel(LOG_OFF);
+	transmit = capture;
+	inboxes[0] = new Inbox();
+	metrics[0] = new WorkerMetrics();
+
+	parsebench(total);
+	for (int batch = 1; batch <= MAXBATCH; batch *= 4)
+		batchbench(batch);
+	for (size_t n = 8; n <= 512; n *= 4)
+		relaybench(n);
+	for (size_t n = 10; n <= maxsize; n *= 10)
+		handlerbench(n, total);
+	for (size_t n = 1000; n <= maxsize && n <= 100000; n *= 10)
+		retransmitbench(n);
+	for (size_t n = 10; n <= maxsize && n <= 1000; n *= 10)
+		replybench(n, total / 10);
+	// populating more takes longer than the lifetimes, entries would come due early
+	for (size_t n = 100; n <= maxsize && n <= 100000; n *= 10)
+		placementbench(n, total);
+	for (size_t n = 1; n <= maxsize && n <= 10000; n *= 10)
+		subscribebench(n, total);
+	for (size_t n = 1000; n <= maxsize && n <= 100000; n *= 10)
+		searchbench(n, total);
+	for (size_t n = 1000; n <= maxsize && n <= 100000; n *= 10)
+		expirybench(n);
+	for (size_t n = 10000; n <= maxsize; n *= 10)
+		restartbench(n);
+	return 0;
+}
@@ -0,0 +1,107 @@
+// parsebench.cpp : Compares the old string based packet parsing with protocol.h.
+//
+// The old path copied the buffer into strings, split the arguments with a
+// stringstream and compared the command against every handler in turn. The
+// new path splits the buffer into string_views and looks the command up in
+// the compile time dispatch table. Global operator new is counted so the
+// output shows heap allocations per packet next to the time per packet.
+//
+// Build: g++ -std=c++17 -O2 -I.. parsebench.cpp -o parsebench
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../protocol.h"
+using namespace std;
+
+static size_t allocations = 0;
+
+void* operator new(size_t n) {
+	++allocations;
+	void* p = malloc(n ? n : 1);
+	if (p == NULL)
+		throw bad_alloc();
+	return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// packets a busy masterserver sees most often
+static const char* packets[] = {
+	"stser US",
+	"pslis 76561197960287930",
+	"pllis US",
+	"pjoin 76561197960287930:US:lobby1",
+	"pjack 76561197960287930:192.168.1.20:50123:US:lobby1",
+	"pinvi 76561197960287930:76561197960287931",
+	"piack 76561197960287930:76561197960287931:US:lobby1",
+	"lobup US:lobby1:76561197960287930:76561197960287931",
+};
+static const int NPACKETS = sizeof(packets) / sizeof(packets[0]);
+
+static const char* names[] = { "stser", "stlob", "slack", "close", "lobup", "pslis", "pllis",
+	"pjoin", "pjack", "pquit", "pinvi", "piack", "clear" };
+
+typedef int(*Handler)(const Request& r);
+static int handled(const Request& r) { return r.nfields; }
+constexpr Command<Handler> commands[] = {
+	{ cmdcode("stser"), handled }, { cmdcode("stlob"), handled }, { cmdcode("slack"), handled },
+	{ cmdcode("close"), handled }, { cmdcode("lobup"), handled }, { cmdcode("pslis"), handled },
+	{ cmdcode("pllis"), handled }, { cmdcode("pjoin"), handled }, { cmdcode("pjack"), handled },
+	{ cmdcode("pquit"), handled }, { cmdcode("pinvi"), handled }, { cmdcode("piack"), handled },
+	{ cmdcode("clear"), handled },
+};
+constexpr auto dispatch = makedispatch(commands);
+
+// the masterserver's parsing before protocol.h
+static int oldparse(const char* buf) {
+	string com = (string)buf; com = com.substr(0, 5);
+	string arg = (string)(buf + 6);
+	int fields = 0;
+	for (int i = 0; i < 13; ++i) {
+		if (com == names[i]) {
+			stringstream ss(arg);
+			string tmp;
+			while (getline(ss, tmp, ':'))
+				++fields;
+			break;
+		}
+	}
+	return fields;
+}
+
+static int newparse(const char* buf, size_t len) {
+	Request r;
+	parserequest(buf, len, r);
+	Handler h = dispatch.find(r.code);
+	return h ? h(r) : 0;
+}
+
+int main(int argc, char** argv) {
+	int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+	vector<size_t> lens;
+	for (int i = 0; i < NPACKETS; ++i)
+		lens.push_back(strlen(packets[i]));
+
+	for (int pass = 0; pass < 2; ++pass) {
+		long checksum = 0;
+		size_t before = allocations;
+		auto start = chrono::steady_clock::now();
+		for (int n = 0; n < rounds; ++n) {
+			for (int i = 0; i < NPACKETS; ++i)
+				checksum += pass == 0 ? oldparse(packets[i]) : newparse(packets[i], lens[i]);
+		}
+		auto end = chrono::steady_clock::now();
+		double total = (double)rounds * NPACKETS;
+		double ns = chrono::duration<double, nano>(end - start).count() / total;
+		printf("%-12s %8.1f ns/packet %6.2f allocs/packet (checksum %ld)\n",
+			pass == 0 ? "stringstream" : "protocol.h", ns, (allocations - before) / total, checksum);
+	}
+	return 0;
+}
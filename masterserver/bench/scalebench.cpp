@@ -0,0 +1,160 @@
+// scalebench.cpp : Requests/sec of the masterserver as the worker count grows.
+//
+// For every worker count from 1 to the number of cores it starts
+// "masterserver -w N -p PORT -t 0 -q", registers a few regions, then has client
+// threads keep a window of pslis/pllis requests in flight from many sockets
+// (so SO_REUSEPORT spreads them over the workers) and counts the replies.
+// Half the requests are keyed by region and half by player, so most of
+// them land on a worker that has to hand them over.
+//
+// Build: g++ -std=c++17 -O2 -pthread scalebench.cpp -o scalebench
+// Run:   scalebench [-s ../masterserver] [-n maxworkers] [-t seconds] [-c clients] [-p port]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include "../netio.h"
+using namespace std;
+
+#define REGIONS 64   // regions registered before measuring
+#define SOCKETS 16   // sockets per client thread
+#define WINDOW 32    // requests in flight per socket
+
+static atomic<bool> running;
+static atomic<uint64_t> replies;
+
+static pid_t startserver(const string& path, int workers, int port) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		string w = to_string(workers), p = to_string(port);
+		// every client socket sends far more than one source may, the limiter would drop it
+		execl(path.c_str(), path.c_str(), "-w", w.c_str(), "-p", p.c_str(), "-t", "0", "-q", (char*)NULL);
+		perror("execl");
+		_exit(1);
+	}
+	return pid;
+}
+
+// registers REGIONS regions so pllis gets answers, returns false if the server isn't up
+static bool setup(const sockaddr_in& master) {
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+	timeval tv = { 0, 200000 };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+	char buf[1024];
+	int acked = 0;
+	for (int tries = 0; tries < 20 && acked < REGIONS; ++tries) {
+		acked = 0;
+		for (int i = 0; i < REGIONS; ++i) {
+			string m = "stser R" + to_string(i);
+			sendto(s, m.c_str(), m.size(), 0, (const sockaddr*)&master, sizeof(master));
+		}
+		while (recv(s, buf, sizeof(buf), 0) > 0)
+			++acked;
+	}
+	closesocket(s);
+	return acked >= REGIONS;
+}
+
+static void client(int id, sockaddr_in master) {
+	vector<SOCKET> socks;
+	for (int i = 0; i < SOCKETS; ++i) {
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+		setnonblocking(s);
+		socks.push_back(s);
+	}
+	char buf[1024];
+	string req;
+	uint64_t n = 0, got = 0;
+	vector<int> inflight(SOCKETS, 0);
+	auto refill = chrono::steady_clock::now();
+	while (running) {
+		bool idle = true;
+		for (int i = 0; i < SOCKETS; ++i) {
+			while (inflight[i] < WINDOW) {
+				if (n++ & 1)
+					req = "pllis R" + to_string((n * 7 + id) % REGIONS);
+				else
+					req = "pslis " + to_string(76561197960000000ull + (n * 13 + id) % 100000);
+				if (sendto(socks[i], req.c_str(), req.size(), 0, (const sockaddr*)&master, sizeof(master)) < 0)
+					break;
+				++inflight[i];
+			}
+			while (recv(socks[i], buf, sizeof(buf), 0) > 0) {
+				--inflight[i];
+				++got;
+				idle = false;
+			}
+		}
+		// lost packets would shrink the window for good, so refill it now and then
+		auto now = chrono::steady_clock::now();
+		if (now - refill > chrono::milliseconds(100)) {
+			fill(inflight.begin(), inflight.end(), 0);
+			refill = now;
+		}
+		if (idle)
+			this_thread::yield();
+	}
+	replies += got;
+	for (SOCKET s : socks)
+		closesocket(s);
+}
+
+int main(int argc, char* argv[]) {
+	string path = "../masterserver";
+	int maxworkers = (int)thread::hardware_concurrency();
+	int seconds = 3, clients = 2, port = 9484;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		string a = argv[i];
+		if (a == "-s") path = argv[i + 1];
+		else if (a == "-n") maxworkers = atoi(argv[i + 1]);
+		else if (a == "-t") seconds = atoi(argv[i + 1]);
+		else if (a == "-c") clients = atoi(argv[i + 1]);
+		else if (a == "-p") port = atoi(argv[i + 1]);
+	}
+	if (maxworkers < 1)
+		maxworkers = 1;
+
+	sockaddr_in master;
+	setaddr(master, "127.0.0.1", (unsigned short)port);
+	printf("%d cores, %d client threads x %d sockets x %d in flight\n",
+		(int)thread::hardware_concurrency(), clients, SOCKETS, WINDOW);
+	printf("workers   requests/s   speedup\n");
+	fflush(stdout);
+	double base = 0;
+	for (int w = 1; w <= maxworkers; ++w) {
+		pid_t pid = startserver(path, w, port);
+		this_thread::sleep_for(chrono::milliseconds(300));
+		if (!setup(master)) {
+			printf("%7d   server did not answer\n", w);
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+			continue;
+		}
+		running = true;
+		replies = 0;
+		vector<thread> threads;
+		for (int c = 0; c < clients; ++c)
+			threads.emplace_back(client, c, master);
+		this_thread::sleep_for(chrono::seconds(seconds));
+		running = false;
+		for (size_t c = 0; c < threads.size(); ++c)
+			threads[c].join();
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+
+		double rate = (double)replies / seconds;
+		if (base == 0)
+			base = rate;
+		printf("%7d   %10.0f   %7.2f\n", w, rate, rate / base);
+		fflush(stdout);
+	}
+	return 0;
+}
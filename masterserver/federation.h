@@ -0,0 +1,167 @@
+// federation.h : Several masterservers sharing the regions and players.
+//
+// Every master of a federation (-n) is given the addresses of all of them.
+// A region or SteamID belongs to the master a consistent hash ring picks:
+// every master has RINGPOINTS points on the ring, placed by hashing its
+// address, and a key belongs to the master of the first point at or after
+// the key's hash. A master that stops beating is left out of the ring, which
+// only gives the keys on its arcs to the masters of the next points, and when
+// it comes back only those keys go back to it. Inside a master, shardof()
+// then picks the worker as it does without a federation.
+//
+// A request for a key another master owns is forwarded to it once, wrapped
+// in xfwrd with the address of whoever sent it. That master remembers which
+// member forwarded for the address and hands its answers, retransmits and
+// pushes to that sender back to that member wrapped in xfrep, which sends
+// them on from the address the sender contacted: a NAT in front of the sender
+// only lets in datagrams from there. Every FEDBEAT the masters send each other the regions they
+// list (xregs), which pslis merges with their own, and a master hands the
+// regions and player games it no longer owns to their new master as the
+// records the journal would keep of them (xmove).
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "shard.h"
+
+#define MAXMEMBERS 64                         // most masters of a federation, bits of a member mask
+#define RINGPOINTS 128                        // points every master has on the ring
+#define FEDBEAT std::chrono::seconds(1)       // time between a master's xregs
+#define FEDTIMEOUT std::chrono::seconds(3)    // quiet time after which a master leaves the ring
+#define MOVECHUNK 400                         // record bytes sent in one xmove
+
+// where key falls on the ring, a hash that doesn't follow the worker's shardof()
+inline uint64_t ringhash(std::string_view key) {
+	uint64_t h = keyhash(key) ^ 0x9e3779b97f4a7c15ull;
+	h ^= h >> 31; h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 29;
+	return h;
+}
+
+// Consistent hash ring of the masters that are up.
+class Ring {
+public:
+	// places the points of the members whose bit is set in mask, names[i] is the address of member i
+	void build(const std::vector<std::string>& names, uint64_t mask) {
+		points.clear();
+		for (size_t i = 0; i < names.size() && i < MAXMEMBERS; ++i) {
+			if (!(mask & (1ull << i)))
+				continue;
+			for (int j = 0; j < RINGPOINTS; ++j)
+				points.push_back(std::make_pair(ringhash(names[i] + "#" + std::to_string(j)), (int)i));
+		}
+		std::sort(points.begin(), points.end());
+		built = mask;
+	}
+
+	// the members the ring was built with
+	uint64_t members() const { return built; }
+
+	// member that owns key, -1 if the ring is empty
+	int owner(std::string_view key) const {
+		if (points.empty())
+			return -1;
+		uint64_t h = ringhash(key);
+		auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(h, -1));
+		if (it == points.end())
+			it = points.begin();
+		return it->second;
+	}
+
+private:
+	std::vector<std::pair<uint64_t, int>> points; // hash and member, sorted by hash
+	uint64_t built = 0;
+};
+
+// The member each sender that reached this master through another one was forwarded by,
+// shared by the workers since any of them may answer it. A sender is forgotten once it
+// sends here itself, or after it is quiet for as long as sweep() is given.
+class Vias {
+public:
+	// key sent its request to member m, which forwarded it here
+	void set(uint64_t key, int m, netclock::time_point now) {
+		std::unique_lock<std::shared_mutex> lock(guard);
+		Via& v = vias[key];
+		v.member = m;
+		v.heard = now;
+		count.store(vias.size(), std::memory_order_relaxed);
+	}
+
+	// key sent here itself
+	void clear(uint64_t key) {
+		if (count.load(std::memory_order_relaxed) == 0)
+			return;
+		{
+			std::shared_lock<std::shared_mutex> lock(guard);
+			if (vias.find(key) == vias.end())
+				return;
+		}
+		std::unique_lock<std::shared_mutex> lock(guard);
+		vias.erase(key);
+		count.store(vias.size(), std::memory_order_relaxed);
+	}
+
+	// the member that answers to key go through, 0 if they go straight to it
+	int member(uint64_t key) const {
+		if (count.load(std::memory_order_relaxed) == 0)
+			return 0;
+		std::shared_lock<std::shared_mutex> lock(guard);
+		auto it = vias.find(key);
+		return it == vias.end() ? 0 : it->second.member;
+	}
+
+	// forgets the senders not forwarded for age
+	void sweep(netclock::time_point now, netclock::duration age) {
+		std::unique_lock<std::shared_mutex> lock(guard);
+		for (auto it = vias.begin(); it != vias.end(); ) {
+			if (now - it->second.heard >= age)
+				it = vias.erase(it);
+			else
+				++it;
+		}
+		count.store(vias.size(), std::memory_order_relaxed);
+	}
+
+private:
+	struct Via {
+		int member;
+		netclock::time_point heard;
+	};
+	mutable std::shared_mutex guard;
+	std::unordered_map<uint64_t, Via> vias;
+	std::atomic<size_t> count{ 0 };      // read without the lock, so a master alone never takes it
+};
+
+// bytes as hex digits, so records survive the text packets they are moved in
+inline void hexencode(std::string_view bytes, std::string& out) {
+	static const char digits[] = "0123456789abcdef";
+	for (char c : bytes) {
+		out += digits[(unsigned char)c >> 4];
+		out += digits[(unsigned char)c & 15];
+	}
+}
+
+// the bytes hex holds, false if it isn't hex
+inline bool hexdecode(std::string_view hex, std::string& out) {
+	auto digit = [](char c) {
+		return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+	};
+	if (hex.size() % 2 != 0)
+		return false;
+	for (size_t i = 0; i < hex.size(); i += 2) {
+		int hi = digit(hex[i]), lo = digit(hex[i + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		out += (char)(hi << 4 | lo);
+	}
+	return true;
+}
@@ -0,0 +1,225 @@
+// log.h : Leveled logging that never makes the logging thread wait on the console.
+//
+// Every thread that logs gets its own ring of fixed size records, written
+// only by that thread and read only by the log thread, so logging a line is
+// a level check, a snprintf into the next free record and a release store.
+// The log thread wakes every few milliseconds, writes everything the rings
+// hold to stdout in time order and flushes once. When a ring is full the
+// line is dropped and counted instead of waiting.
+//
+// Large text that is only written on demand, like a dump of the registry,
+// goes through text() instead, which takes a lock but doesn't fill the rings.
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOGLEN 240       // longest line, longer ones are cut
+#define LOGRECORDS 1024  // lines a thread can have waiting for the log thread
+#define LOGRINGS 128     // most threads that can log
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+// logs a printf style line if level is enabled, the arguments aren't evaluated otherwise
+#define LOG(lvl, ...) do { if ((lvl) >= logger().level()) logger().write((lvl), __VA_ARGS__); } while (0)
+
+// printf arguments for a string_view, with "%.*s"
+#define LOGSV(s) (int)(s).size(), (s).data()
+
+// level named by "debug", "info", "warn", "error" or "off", LOG_OFF + 1 if none is
+inline int loglevel(const char* name) {
+	static const char* names[] = { "debug", "info", "warn", "error", "off" };
+	for (int l = LOG_DEBUG; l <= LOG_OFF; ++l)
+		if (strcmp(name, names[l]) == 0)
+			return l;
+	return LOG_OFF + 1;
+}
+
+class Logger {
+public:
+	Logger() : minlevel(LOG_INFO), stopping(false), dropped(0), nrings(0) {
+		for (int i = 0; i < LOGRINGS; ++i)
+			rings[i].store(nullptr, std::memory_order_relaxed);
+		thread = std::thread(&Logger::run, this);
+	}
+	~Logger() {
+		stopping.store(true);
+		thread.join();
+		drain();
+	}
+
+	LogLevel level() const { return (LogLevel)minlevel.load(std::memory_order_relaxed); }
+	void setlevel(int l) { minlevel.store(l, std::memory_order_relaxed); }
+	// names the calling thread's lines, e.g. "w3" for worker 3
+	void setname(const char* name) {
+		Ring* r = ring();
+		if (r != nullptr)
+			snprintf(r->name, sizeof(r->name), "%s", name);
+	}
+
+	// queues a line for the log thread, or drops it if this thread's ring is full
+	void write(LogLevel l, const char* fmt, ...)
+#ifdef __GNUC__
+		__attribute__((format(printf, 3, 4)))
+#endif
+	{
+		Ring* r = ring();
+		if (r == nullptr) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		size_t t = r->tail.load(std::memory_order_relaxed);
+		if (t - r->head.load(std::memory_order_acquire) == LOGRECORDS) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		Record& rec = r->records[t & (LOGRECORDS - 1)];
+		rec.when = std::chrono::system_clock::now();
+		rec.level = (uint8_t)l;
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(rec.text, LOGLEN, fmt, ap);
+		va_end(ap);
+		rec.len = (uint16_t)(n < 0 ? 0 : n < LOGLEN ? n : LOGLEN - 1);
+		r->tail.store(t + 1, std::memory_order_release);
+	}
+
+	// queues text written as is after the lines queued before it
+	void text(std::string t) {
+		std::lock_guard<std::mutex> g(textlock);
+		texts.push_back(std::move(t));
+	}
+
+	// writes everything queued so far, from any thread
+	void flush() { drain(); }
+	// lines lost to full rings
+	uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+	struct Record {
+		std::chrono::system_clock::time_point when;
+		uint8_t level;
+		uint16_t len;
+		char text[LOGLEN];
+	};
+	struct Ring {
+		alignas(64) std::atomic<size_t> head{0}; // next record the log thread reads
+		alignas(64) std::atomic<size_t> tail{0}; // next record the owner writes
+		char name[16];
+		Record records[LOGRECORDS];
+	};
+	struct Line {
+		std::chrono::system_clock::time_point when;
+		const Ring* ring;
+		const Record* rec;
+	};
+
+	// the calling thread's ring, made the first time it logs, null once LOGRINGS threads have one
+	Ring* ring() {
+		thread_local Ring* mine = nullptr;
+		if (mine == nullptr) {
+			int i = nrings.fetch_add(1);
+			if (i >= LOGRINGS)
+				return nullptr;
+			mine = new Ring();
+			snprintf(mine->name, sizeof(mine->name), "t%d", i);
+			rings[i].store(mine, std::memory_order_release);
+		}
+		return mine;
+	}
+
+	void run() {
+		while (!stopping.load()) {
+			if (!drain())
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	}
+
+	// writes what the rings and texts hold, returns false if there was nothing
+	bool drain() {
+		std::lock_guard<std::mutex> g(drainlock);
+		// lines from all rings, merged in time order, each ring is in order already
+		std::vector<Line> lines;
+		std::vector<size_t> ends(LOGRINGS, 0);
+		for (int i = 0; i < LOGRINGS; ++i) {
+			Ring* r = rings[i].load(std::memory_order_acquire);
+			if (r == nullptr)
+				continue;
+			size_t h = r->head.load(std::memory_order_relaxed);
+			ends[i] = r->tail.load(std::memory_order_acquire);
+			for (size_t k = h; k < ends[i]; ++k) {
+				const Record& rec = r->records[k & (LOGRECORDS - 1)];
+				lines.push_back(Line{ rec.when, r, &rec });
+			}
+		}
+		std::vector<std::string> blocks;
+		{
+			std::lock_guard<std::mutex> t(textlock);
+			blocks.swap(texts);
+		}
+		if (lines.empty() && blocks.empty())
+			return false;
+
+		std::stable_sort(lines.begin(), lines.end(),
+			[](const Line& a, const Line& b) { return a.when < b.when; });
+		static const char* names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+		std::string out;
+		for (const Line& l : lines) {
+			char stamp[32];
+			time_t secs = std::chrono::system_clock::to_time_t(l.when);
+			int ms = (int)(std::chrono::duration_cast<std::chrono::milliseconds>(l.when.time_since_epoch()).count() % 1000);
+			tm t;
+#ifdef _WIN32
+			localtime_s(&t, &secs);
+#else
+			localtime_r(&secs, &t);
+#endif
+			snprintf(stamp, sizeof(stamp), "%02d:%02d:%02d.%03d ", t.tm_hour, t.tm_min, t.tm_sec, ms);
+			out += stamp;
+			out += l.ring->name;
+			out += ' ';
+			out += names[l.rec->level < LOG_OFF ? l.rec->level : (int)LOG_ERROR];
+			out += ' ';
+			out.append(l.rec->text, l.rec->len);
+			out += '\n';
+		}
+		// the records are copied, hand them back to their threads
+		for (int i = 0; i < LOGRINGS; ++i) {
+			Ring* r = rings[i].load(std::memory_order_relaxed);
+			if (r != nullptr)
+				r->head.store(ends[i], std::memory_order_release);
+		}
+		for (const std::string& b : blocks)
+			out += b;
+		fwrite(out.data(), 1, out.size(), stdout);
+		fflush(stdout);
+		return true;
+	}
+
+	std::atomic<int> minlevel;
+	std::atomic<bool> stopping;
+	std::atomic<uint64_t> dropped;
+	std::atomic<int> nrings;
+	std::atomic<Ring*> rings[LOGRINGS];
+	std::mutex drainlock;   // one drain at a time, the rings have a single reader
+	std::mutex textlock;
+	std::vector<std::string> texts;
+	std::thread thread;
+};
+
+// the process' logger, its thread starts the first time it is used
+inline Logger& logger() {
+	static Logger l;
+	return l;
+}
@@ -0,0 +1,104 @@
+// metrics.h : Counters and latency histograms for the masterserver.
+//
+// Every metric has a single writer, the worker that owns it, and may be read
+// at any time by another thread that reports it. Writes are relaxed loads and
+// stores of atomics, so a worker never takes a lock or a contended cache
+// line to count, and reading never stops a worker; a report may just be a
+// few packets behind.
+//
+// Histogram buckets are log-linear like HdrHistogram's: values below
+// HISTSUB get a bucket each, above that every power of two is split into
+// HISTSUB buckets, so any value is reported within 1/HISTSUB of itself.
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define HISTSUB 8       // buckets per power of two, the precision of a histogram
+#define HISTBITS 40     // values of 2^HISTBITS and more share the last bucket (18 min in ns)
+#define HISTBUCKETS ((HISTBITS - 2) * HISTSUB)
+
+// count that only its owner increments
+class Counter {
+public:
+	void add(uint64_t n = 1) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	uint64_t get() const { return v.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> v{0};
+};
+
+// bucket that value v is counted in
+inline size_t histbucket(uint64_t v) {
+	if (v < HISTSUB)
+		return (size_t)v;
+	int msb = 63;
+	while (!(v >> msb))
+		--msb;
+	if (msb >= HISTBITS)
+		return HISTBUCKETS - 1;
+	int shift = msb - 3; // log2(HISTSUB)
+	return (size_t)(shift + 1) * HISTSUB + (size_t)((v >> shift) - HISTSUB);
+}
+
+// largest value counted in bucket b
+inline uint64_t histupper(size_t b) {
+	if (b < HISTSUB)
+		return b;
+	int shift = (int)(b / HISTSUB) - 1;
+	return ((uint64_t)(b % HISTSUB + HISTSUB + 1) << shift) - 1;
+}
+
+// distribution of values, e.g. nanoseconds a handler took, that only its owner records
+class Histogram {
+public:
+	void record(uint64_t v) {
+		std::atomic<uint64_t>& b = buckets[histbucket(v)];
+		b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (v > top.load(std::memory_order_relaxed))
+			top.store(v, std::memory_order_relaxed);
+	}
+	uint64_t bucket(size_t b) const { return buckets[b].load(std::memory_order_relaxed); }
+	uint64_t max() const { return top.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> buckets[HISTBUCKETS] = {};
+	std::atomic<uint64_t> top{0};
+};
+
+// a copy of one or more Histograms, e.g. the same one of every worker, for reporting
+class HistogramSum {
+public:
+	void add(const Histogram& h) {
+		for (size_t b = 0; b < HISTBUCKETS; ++b) {
+			uint64_t n = h.bucket(b);
+			buckets[b] += n;
+			total += n;
+		}
+		if (h.max() > top)
+			top = h.max();
+	}
+	uint64_t count() const { return total; }
+	uint64_t max() const { return top; }
+	// value that fraction q (0 to 1) of the values are at most, within the bucket precision
+	uint64_t quantile(double q) const {
+		if (total == 0)
+			return 0;
+		uint64_t rank = (uint64_t)(q * (double)total);
+		if (rank >= total)
+			rank = total - 1;
+		uint64_t seen = 0;
+		for (size_t b = 0; b < HISTBUCKETS; ++b) {
+			seen += buckets[b];
+			if (seen > rank)
+				return histupper(b) < top ? histupper(b) : top;
+		}
+		return top;
+	}
+
+private:
+	uint64_t buckets[HISTBUCKETS] = {};
+	uint64_t total = 0;
+	uint64_t top = 0;
+};
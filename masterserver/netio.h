@@ -0,0 +1,387 @@
+// netio.h : Socket and event loop abstraction used by the masterserver.
+//
+// On Windows this wraps Winsock and waits with select(). On Linux the loop
+// sleeps in epoll_wait() on the UDP socket and a timerfd, so the process is
+// idle until a datagram arrives or the next retransmission deadline passes.
+//
+// Datagrams are moved in batches where the system allows it: RecvBatch drains
+// up to a batch of waiting datagrams with one recvmmsg(), and SendBatch keeps
+// what the handlers send until the worker flushes it with one sendmmsg(). On
+// Windows both fall back to one recvfrom() or sendto() per datagram.
+//
+// Linux build:   g++ -std=c++17 -O2 -pthread masterserver.cpp -o masterserver
+// Windows build: add the .cpp to a console project, link ws2_32.lib
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib,"ws2_32.lib") //Winsock Library
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR   (-1)
+#define closesocket    close
+#endif
+
+// monotonic clock used for every deadline in the masterserver
+typedef std::chrono::steady_clock netclock;
+
+#define MAXBATCH 64    // most datagrams moved by one recvmmsg() or sendmmsg()
+#define DGRAMLEN 1024  // largest datagram a batch holds
+
+// reasons EventLoop::wait() returned
+enum WakeReason : int {
+	WAKE_NONE = 0,
+	WAKE_READ = 1,  // socket has datagrams waiting
+	WAKE_TIMER = 2, // the armed deadline has passed
+	WAKE_INBOX = 4  // another worker handed this one packets
+};
+
+// initialise the socket library (WSAStartup on Windows)
+inline bool netstartup() {
+#ifdef _WIN32
+	WSADATA wsa;
+	return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+	return true;
+#endif
+}
+
+// release the socket library
+inline void netcleanup() {
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+// last socket error code for this thread
+inline int sockerror() {
+#ifdef _WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+// true if err only means there was nothing to read or no room to write
+inline bool wouldblock(int err) {
+#ifdef _WIN32
+	return err == WSAEWOULDBLOCK;
+#else
+	return err == EWOULDBLOCK || err == EAGAIN || err == EINTR;
+#endif
+}
+
+// set socket to non-blocking, returns 0 on success
+inline int setnonblocking(SOCKET s) {
+#ifdef _WIN32
+	u_long mode = 1;
+	return ioctlsocket(s, FIONBIO, &mode);
+#else
+	int fl = fcntl(s, F_GETFL, 0);
+	return fl < 0 ? -1 : fcntl(s, F_SETFL, fl | O_NONBLOCK);
+#endif
+}
+
+#ifndef _WIN32
+// binds a unix socket to name in the abstract namespace, which only one process can hold
+// and which goes away when it exits or dies; returns it, or INVALID_SOCKET if it's taken
+inline SOCKET holdname(const std::string& name) {
+	SOCKET f = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (f == INVALID_SOCKET)
+		return f;
+	sockaddr_un a;
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	size_t n = std::min(name.size(), sizeof(a.sun_path) - 1);
+	memcpy(a.sun_path + 1, name.data(), n);
+	if (::bind(f, (sockaddr*)&a, (socklen_t)(offsetof(sockaddr_un, sun_path) + 1 + n)) != 0) {
+		int err = errno;
+		close(f);
+		errno = err;
+		return INVALID_SOCKET;
+	}
+	return f;
+}
+#endif
+
+// fills in a sockaddr_in from a dotted ip and a port
+inline void setaddr(sockaddr_in& a, const char* ip, unsigned short port) {
+	memset((char *)&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = inet_addr(ip);
+}
+
+// Datagrams received together, in buffers allocated once.
+class RecvBatch {
+public:
+	RecvBatch() {
+#ifndef _WIN32
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < MAXBATCH; ++i) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = DGRAMLEN - 1;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+		}
+#endif
+	}
+
+	// receives the datagrams waiting on s, at most n (up to MAXBATCH), returns how many,
+	// or SOCKET_ERROR if there were none or the receive failed
+	int receive(SOCKET s, int n) {
+		if (n > MAXBATCH)
+			n = MAXBATCH;
+#ifdef _WIN32
+		int fromlen = sizeof(addrs[0]);
+		int len = recvfrom(s, bufs[0], DGRAMLEN - 1, 0, (sockaddr*)&addrs[0], &fromlen);
+		if (len == SOCKET_ERROR)
+			return SOCKET_ERROR;
+		lens[0] = len;
+		n = 1;
+#else
+		for (int i = 0; i < n; ++i)
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		n = recvmmsg(s, msgs, (unsigned)n, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			return SOCKET_ERROR;
+		for (int i = 0; i < n; ++i)
+			lens[i] = (int)msgs[i].msg_len;
+#endif
+		for (int i = 0; i < n; ++i)
+			bufs[i][lens[i]] = '\0';
+		return n;
+	}
+
+	// the i-th datagram of the last receive, NUL terminated
+	const char* data(int i) const { return bufs[i]; }
+	int len(int i) const { return lens[i]; }
+	const sockaddr_in& from(int i) const { return addrs[i]; }
+
+private:
+	char bufs[MAXBATCH][DGRAMLEN];
+	int lens[MAXBATCH];
+	sockaddr_in addrs[MAXBATCH];
+#ifndef _WIN32
+	mmsghdr msgs[MAXBATCH];
+	iovec iovs[MAXBATCH];
+#endif
+};
+
+// Datagrams queued to be sent together. Nothing goes out until flush().
+class SendBatch {
+public:
+	SendBatch() {
+#ifndef _WIN32
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < MAXBATCH; ++i) {
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+#endif
+	}
+
+	// copies a datagram of at most DGRAMLEN bytes into the batch, which must not be full
+	void queue(const char* data, int len, const sockaddr_in& to) {
+		memcpy(bufs[count], data, (size_t)len);
+		lens[count] = len;
+		addrs[count] = to;
+		++count;
+	}
+	int pending() const { return count; }
+	bool full() const { return count == MAXBATCH; }
+
+	// sends everything queued on s, returns the number of calls it took; err is set to the
+	// error of a call that failed, the datagrams it didn't send are dropped as a failed sendto()
+	// drops its one
+	int flush(SOCKET s, int& err) {
+		int calls = 0;
+		err = 0;
+#ifdef _WIN32
+		for (int i = 0; i < count; ++i, ++calls)
+			if (sendto(s, bufs[i], lens[i], 0, (const sockaddr*)&addrs[i], sizeof(addrs[i])) == SOCKET_ERROR)
+				err = sockerror();
+#else
+		for (int i = 0; i < count; ++i) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = (size_t)lens[i];
+		}
+		// a partial send leaves the rest for another call
+		for (int sent = 0; sent < count; ) {
+			int n = sendmmsg(s, msgs + sent, (unsigned)(count - sent), 0);
+			++calls;
+			if (n < 0) {
+				err = errno;
+				if (err == EINTR)
+					continue;
+				++sent; // skip the datagram that failed
+				continue;
+			}
+			sent += n;
+		}
+#endif
+		count = 0;
+		return calls;
+	}
+
+private:
+	char bufs[MAXBATCH][DGRAMLEN];
+	int lens[MAXBATCH];
+	sockaddr_in addrs[MAXBATCH];
+	int count = 0;
+#ifndef _WIN32
+	mmsghdr msgs[MAXBATCH];
+	iovec iovs[MAXBATCH];
+#endif
+};
+
+// Waits for the masterserver socket to become readable or for a deadline.
+// Only one deadline is armed at a time; the caller re-arms it with the
+// earliest pending retransmission before every wait.
+class EventLoop {
+public:
+	EventLoop() {}
+	~EventLoop() { close(); }
+
+	// start watching socket s, and the wakeup fd of the worker's inbox if it has one,
+	// returns false if the loop could not be created
+	bool open(SOCKET s, int inboxfd = -1) {
+		sock = s;
+#ifndef _WIN32
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (epfd < 0 || tfd < 0)
+			return false;
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = s;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+			return false;
+		ev.data.fd = tfd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+			return false;
+		wakefd = inboxfd;
+		ev.data.fd = wakefd;
+		if (wakefd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+			return false;
+#endif
+		return true;
+	}
+
+	void close() {
+#ifndef _WIN32
+		if (tfd >= 0) ::close(tfd);
+		if (epfd >= 0) ::close(epfd);
+		tfd = epfd = -1;
+#endif
+	}
+
+	// arm the wakeup for deadline, replacing any earlier one
+	void arm(netclock::time_point deadline) {
+		if (armed && deadline == armedat)
+			return;
+		armed = true;
+		armedat = deadline;
+#ifndef _WIN32
+		itimerspec its;
+		memset(&its, 0, sizeof(its));
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+		if (ns <= 0) ns = 1; // zero would disarm the timer
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+	}
+
+	// remove the wakeup, wait() then only returns for incoming datagrams
+	void disarm() {
+		if (!armed)
+			return;
+		armed = false;
+#ifndef _WIN32
+		itimerspec its;
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(tfd, 0, &its, NULL);
+#endif
+	}
+
+	// sleep until the socket is readable or the armed deadline passes
+	// returns a mask of WakeReason values
+	int wait() {
+		int reason = WAKE_NONE;
+#ifdef _WIN32
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+		timeval tv, *ptv = NULL;
+		if (armed) {
+			auto left = std::chrono::duration_cast<std::chrono::microseconds>(armedat - netclock::now()).count();
+			if (left < 0) left = 0;
+			tv.tv_sec = (long)(left / 1000000);
+			tv.tv_usec = (long)(left % 1000000);
+			ptv = &tv;
+		}
+		int n = select(0, &rfds, NULL, NULL, ptv);
+		if (n > 0)
+			reason |= WAKE_READ;
+#else
+		epoll_event evs[3];
+		int n = epoll_wait(epfd, evs, 3, -1);
+		for (int i = 0; i < n; ++i) {
+			if (evs[i].data.fd == tfd) {
+				uint64_t expirations;
+				while (read(tfd, &expirations, sizeof(expirations)) > 0) {}
+			}
+			else if (evs[i].data.fd == wakefd) {
+				uint64_t wakeups;
+				while (read(wakefd, &wakeups, sizeof(wakeups)) > 0) {}
+				reason |= WAKE_INBOX;
+			}
+			else {
+				reason |= WAKE_READ;
+			}
+		}
+#endif
+		if (armed && netclock::now() >= armedat) {
+			armed = false;
+			reason |= WAKE_TIMER;
+		}
+		return reason;
+	}
+
+private:
+	SOCKET sock = INVALID_SOCKET;
+	bool armed = false;
+	netclock::time_point armedat;
+#ifndef _WIN32
+	int epfd = -1;
+	int tfd = -1;
+	int wakefd = -1; // owned by the Inbox, not closed here
+#endif
+};
@@ -0,0 +1,678 @@
+// persist.h : Write-ahead log and snapshots that bring the registry back after a restart.
+//
+// Every change a worker makes to its registry (stser, slack, lbinf, close, pjack,
+// pquit and the packets workers hand each other for them) is appended to
+// the worker's log as a record. Records are buffered and written with one
+// write() per loop turn, before the worker sleeps, so a crash loses at most
+// the packets of the turn it happened in.
+//
+// Once a log grows past JOURNALLIMIT the worker starts a new log generation
+// and builds the records that would rebuild its registry into a snapshot, a
+// few regions per loop turn (SNAPSHOTSTEP bytes), between the packets it
+// serves. A region built before a change and one built after it both come out
+// right, because the new log has the change and every record sets what it
+// records (a lobby is there with its server, a player is in a lobby) instead
+// of changing it, so replaying a change a region already has leaves it as it
+// is. Once built, a writer thread writes the snapshot, fsyncs it, renames it
+// over the old one and deletes the logs it replaces. A restart maps the
+// snapshot and replays the logs from its generation on.
+//
+// Files in the journal directory, for worker w:
+//   shard<w>.snap           snapshot, its generation is in the header
+//   shard<w>.<gen>.wal      log of generation gen, replayed if gen >= the snapshot's
+// Records: u32 length of type and fields, u8 type, every field as u16 length
+// and bytes, u32 FNV-1a of type and fields. A record that is cut short or
+// doesn't match its checksum ends the file, it was being written at a crash.
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "registry.h"
+#include "shard.h"
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define JOURNALMAGIC 0x314a534du      // "MSJ1"
+#define JOURNALLIMIT (64u << 20)      // log bytes after which a worker writes a snapshot
+#define JOURNALFIELDS 6               // most fields of a record
+#define JOURNALBUFFER (64u << 10)     // queued bytes that are written without waiting for flush()
+#define SNAPSHOTSTEP (64u << 10)      // snapshot bytes a worker builds in one loop turn, about a ms
+
+// what a record records, the first field is always the region or SteamID whose worker keeps it
+enum RecordType : char {
+	REC_REGION = 'R', // region                        region listed (snapshots only)
+	REC_UNLIST = 'U', // region                        region unlisted, moved to another master
+	REC_SERVER = 'S', // region, addr, host            open server registered by stser
+	REC_LOBBY = 'L',  // region, lobby, addr, slots    lobby started by slack
+	REC_INFO = 'I',   // region, lobby, mode, map, password, version    what lbinf says of a lobby
+	REC_CLOSE = 'C',  // region, lobby                 lobby closed, or expired with its server
+	REC_DROP = 'D',   // region, addr                  open server expired
+	REC_JOIN = 'J',   // region, lobby, SteamID, addr  player joined a lobby, pjack
+	REC_LEAVE = 'Q',  // region, SteamID               player left their lobby
+	REC_GAME = 'G',   // SteamID, region, lobby        game kept by another worker, empty region for none
+	REC_WIPE = 'W',   // (none)                        everything before is gone, clear
+	REC_BEAT = 'B',   // (none)                        primary is alive, only sent to a standby (replica.h)
+};
+
+// header at the start of every journal file
+struct JournalHeader {
+	uint32_t magic = JOURNALMAGIC;
+	uint32_t snapshot = 0;   // 1 for a snapshot, 0 for a log
+	uint32_t shard = 0;      // worker that wrote it
+	uint32_t workers = 0;    // workers the masterserver ran with, keys are sharded by it
+	uint64_t generation = 0;
+};
+
+// a record read back, its fields point into the mapped file
+struct JournalRecord {
+	char type = 0;
+	int nfields = 0;
+	std::string_view field[JOURNALFIELDS];
+};
+
+// the 6 bytes an address is kept in by a record, ip then port as sockaddr_in has them
+struct AddrField {
+	char bytes[6];
+	explicit AddrField(const Endpoint& e) {
+		memcpy(bytes, &e.addr.sin_addr.s_addr, 4);
+		memcpy(bytes + 4, &e.addr.sin_port, 2);
+	}
+	operator std::string_view() const { return std::string_view(bytes, sizeof(bytes)); }
+};
+
+// a count, e.g. the slots of a lobby, as a 4 byte field
+struct CountField {
+	char bytes[4];
+	explicit CountField(uint32_t n) { memcpy(bytes, &n, 4); }
+	operator std::string_view() const { return std::string_view(bytes, sizeof(bytes)); }
+};
+
+// the count in field f, 0 if it doesn't hold one (records from before it was logged)
+inline uint32_t fieldcount(std::string_view f) {
+	uint32_t n = 0;
+	if (f.size() == 4)
+		memcpy(&n, f.data(), 4);
+	return n;
+}
+
+inline bool fieldendpoint(std::string_view f, Endpoint& e) {
+	if (f.size() != 6)
+		return false;
+	sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	memcpy(&a.sin_addr.s_addr, f.data(), 4);
+	memcpy(&a.sin_port, f.data() + 4, 2);
+	e = makeendpoint(a);
+	return true;
+}
+
+inline uint32_t journalsum(const char* p, size_t n) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < n; ++i) { h ^= (unsigned char)p[i]; h *= 16777619u; }
+	return h;
+}
+
+inline void appendrecord(std::string& out, char type, std::initializer_list<std::string_view> fields) {
+	size_t start = out.size();
+	uint32_t len = 1;
+	for (std::string_view f : fields)
+		len += 2 + (uint32_t)f.size();
+	out.append((const char*)&len, 4);
+	out += type;
+	for (std::string_view f : fields) {
+		uint16_t n = (uint16_t)f.size();
+		out.append((const char*)&n, 2);
+		out.append(f.data(), n);
+	}
+	uint32_t sum = journalsum(out.data() + start + 4, len);
+	out.append((const char*)&sum, 4);
+}
+
+// reads the record at p and moves p past it, false at the end or at a torn or corrupt record
+inline bool nextrecord(const char*& p, const char* end, JournalRecord& rec) {
+	uint32_t len, sum;
+	if (end - p < 9)
+		return false;
+	memcpy(&len, p, 4);
+	if (len < 1 || (uint64_t)(end - p) < 8ull + len)
+		return false;
+	const char* body = p + 4;
+	memcpy(&sum, body + len, 4);
+	if (sum != journalsum(body, len))
+		return false;
+	rec.type = body[0];
+	rec.nfields = 0;
+	const char* f = body + 1;
+	const char* fend = body + len;
+	while (f < fend) {
+		uint16_t n;
+		if (fend - f < 2 || rec.nfields == JOURNALFIELDS)
+			return false;
+		memcpy(&n, f, 2);
+		if (fend - f - 2 < n)
+			return false;
+		rec.field[rec.nfields++] = std::string_view(f + 2, n);
+		f += 2 + n;
+	}
+	p = fend + 4;
+	return true;
+}
+
+// the lobby the last record applied was about, a snapshot lists the players of a lobby right after it
+struct ReplayHint {
+	std::string_view region;
+	std::string_view lobby;
+	uint32_t l = NOID;
+};
+
+// makes the change rec records to reg
+inline void applyrecord(Registry& reg, const JournalRecord& rec, ReplayHint& hint) {
+	std::string_view none;
+	const std::string_view& f0 = rec.nfields > 0 ? rec.field[0] : none;
+	const std::string_view& f1 = rec.nfields > 1 ? rec.field[1] : none;
+	const std::string_view& f2 = rec.nfields > 2 ? rec.field[2] : none;
+	const std::string_view& f3 = rec.nfields > 3 ? rec.field[3] : none;
+	const std::string_view& f4 = rec.nfields > 4 ? rec.field[4] : none;
+	const std::string_view& f5 = rec.nfields > 5 ? rec.field[5] : none;
+	Endpoint a;
+	switch (rec.type) {
+	case REC_REGION:
+		reg.addregion(f0);
+		break;
+	case REC_UNLIST: {
+		uint32_t r = reg.findregion(f0);
+		if (r != NOID)
+			reg.unlistregion(r);
+		break;
+	}
+	case REC_SERVER:
+		if (fieldendpoint(f1, a) && reg.findserver(a) == NOID)
+			reg.addopenserver(reg.addregion(f0), a, f2);
+		break;
+	case REC_LOBBY:
+		if (fieldendpoint(f2, a)) {
+			uint32_t r = reg.addregion(f0);
+			hint.l = reg.addlobby(r, f1, a, fieldcount(f3));
+			// a lobby whose server hosts another already isn't started, nor listed alone
+			if (hint.l == NOID && reg.region(r).lobbies.empty() && reg.region(r).open.empty())
+				reg.unlistregion(r);
+			hint.region = f0;
+			hint.lobby = f1;
+		}
+		break;
+	case REC_INFO: {
+		uint32_t l = reg.findlobby(reg.listedregion(f0), f1);
+		if (l != NOID)
+			reg.setattributes(l, f2, f3, fieldcount(f4) != 0, fieldcount(f5));
+		break;
+	}
+	case REC_CLOSE: {
+		uint32_t l = reg.findlobby(reg.listedregion(f0), f1);
+		if (l != NOID)
+			reg.removelobby(l);
+		hint = ReplayHint();
+		break;
+	}
+	case REC_DROP: {
+		uint32_t sv = fieldendpoint(f1, a) ? reg.findserver(a) : NOID;
+		if (sv != NOID && reg.server(sv).lobby == NOID)
+			reg.removeserver(sv);
+		break;
+	}
+	case REC_JOIN: {
+		if (hint.l == NOID || f0 != hint.region || f1 != hint.lobby) {
+			hint.l = reg.findlobby(reg.listedregion(f0), f1);
+			hint.region = f0;
+			hint.lobby = f1;
+		}
+		if (hint.l != NOID && fieldendpoint(f3, a))
+			reg.join(reg.setplayeraddr(f2, a), hint.l);
+		break;
+	}
+	case REC_LEAVE: {
+		uint32_t p = reg.findplayer(f1);
+		if (p != NOID)
+			reg.leave(p);
+		break;
+	}
+	case REC_GAME: {
+		// a game this worker keeps itself wins, as it does when the workers are sharded again
+		uint32_t p = reg.addplayer(f0);
+		if (reg.player(p).lobby == NOID)
+			reg.setremotegame(p, f1, f2);
+		break;
+	}
+	case REC_WIPE:
+		reg.clear();
+		hint = ReplayHint();
+		break;
+	}
+}
+
+// Builds the records that rebuild a registry a region at a time, and then the games of the
+// players kept by other workers, so it can go on over several loop turns while the registry
+// changes. A region is always built whole, its lobby list is reordered by closes.
+class SnapshotBuilder {
+public:
+	void start() {
+		region = 0;
+		player = 0;
+	}
+
+	// appends the records of the next regions and players to out until it grew by budget
+	// bytes, true once every one was built
+	bool next(const Registry& reg, std::string& out, size_t budget) {
+		size_t begin = out.size();
+		for (; region < reg.regioncapacity() && out.size() - begin < budget; ++region) {
+			if (reg.regioninuse(region))
+				buildregion(reg, region, out);
+		}
+		// most players have no such game, so the ones looked at count too
+		size_t looked = 0;
+		for (; player < reg.playercapacity() && out.size() - begin + looked < budget; ++player, looked += 8) {
+			if (!reg.playerinuse(player) || reg.player(player).game.empty())
+				continue;
+			std::string_view game = reg.player(player).game;
+			size_t colon = game.find(':');
+			appendrecord(out, REC_GAME, { reg.playername(player), game.substr(0, colon), game.substr(colon + 1) });
+		}
+		return region >= reg.regioncapacity() && player >= reg.playercapacity();
+	}
+
+private:
+	static void buildregion(const Registry& reg, uint32_t r, std::string& out) {
+		std::string_view region = reg.regionname(r);
+		const Registry::Region& rg = reg.region(r);
+		if (rg.listed)
+			appendrecord(out, REC_REGION, { region });
+		for (uint32_t sv : rg.open)
+			appendrecord(out, REC_SERVER, { region, AddrField(reg.server(sv).addr), reg.hostname(reg.server(sv).host) });
+		for (uint32_t l : rg.lobbies) {
+			std::string_view lname = reg.lobbyname(l);
+			appendrecord(out, REC_LOBBY, { region, lname, AddrField(reg.lobby(l).server), CountField(reg.lobby(l).slots) });
+			const Registry::Lobby& lobby = reg.lobby(l);
+			if (reg.described(l))
+				appendrecord(out, REC_INFO, { region, lname, reg.lobbymode(l), reg.lobbymap(l),
+					CountField(lobby.password ? 1 : 0), CountField(lobby.version) });
+			for (uint32_t p : reg.lobby(l).players)
+				appendrecord(out, REC_JOIN, { region, lname, reg.playername(p), AddrField(reg.player(p).addr) });
+		}
+	}
+
+	uint32_t region = 0;  // next region to build
+	uint32_t player = 0;  // next player, once the regions are built
+};
+
+// the records that rebuild reg, appended to out
+inline void snapshotof(const Registry& reg, std::string& out) {
+	SnapshotBuilder b;
+	b.next(reg, out, SIZE_MAX);
+}
+
+// a journal file found in the journal directory
+struct JournalFile {
+	std::string path;
+	JournalHeader header;
+};
+
+#ifndef _WIN32
+
+inline std::string journalpath(const std::string& dir, uint32_t shard, bool snapshot, uint64_t gen) {
+	char name[64];
+	if (snapshot)
+		snprintf(name, sizeof(name), "/shard%u.snap", shard);
+	else
+		snprintf(name, sizeof(name), "/shard%u.%llu.wal", shard, (unsigned long long)gen);
+	return dir + name;
+}
+
+// the journal files in dir, by shard, each shard's snapshot first and then its logs
+// in generation order; creates dir if there is none, false if it can't be used
+inline bool listjournals(const std::string& dir, std::vector<JournalFile>& files) {
+	files.clear();
+	mkdir(dir.c_str(), 0755);
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr)
+		return false;
+	while (dirent* e = readdir(d)) {
+		if (strncmp(e->d_name, "shard", 5) != 0)
+			continue;
+		JournalFile f;
+		f.path = dir + "/" + e->d_name;
+		int fd = ::open(f.path.c_str(), O_RDONLY);
+		if (fd < 0)
+			continue;
+		// a file is only taken if its name is the one its header gives, which leaves out .tmp files
+		bool ok = pread(fd, &f.header, sizeof(f.header), 0) == (ssize_t)sizeof(f.header)
+			&& f.header.magic == JOURNALMAGIC
+			&& f.path == journalpath(dir, f.header.shard, f.header.snapshot != 0, f.header.generation);
+		::close(fd);
+		if (ok)
+			files.push_back(f);
+	}
+	closedir(d);
+	std::sort(files.begin(), files.end(), [](const JournalFile& a, const JournalFile& b) {
+		if (a.header.shard != b.header.shard)
+			return a.header.shard < b.header.shard;
+		if (a.header.snapshot != b.header.snapshot)
+			return a.header.snapshot > b.header.snapshot;
+		return a.header.generation < b.header.generation;
+	});
+	return true;
+}
+
+// replays into reg the files of every shard (only shard's own if all) that hold keys of
+// shard out of workers: its snapshot and the logs from the snapshot's generation on,
+// starting after the last clear; returns the records applied
+inline size_t replayjournals(const std::vector<JournalFile>& files, int shard, int workers, bool all, Registry& reg) {
+	size_t applied = 0;
+	for (size_t first = 0; first < files.size();) {
+		uint32_t s = files[first].header.shard;
+		size_t last = first;
+		while (last < files.size() && files[last].header.shard == s)
+			++last;
+		if (!all && s != (uint32_t)shard) {
+			first = last;
+			continue;
+		}
+		// the snapshot and the logs it doesn't cover, mapped
+		uint64_t from = files[first].header.snapshot ? files[first].header.generation : 0;
+		std::vector<std::pair<const char*, size_t>> maps;
+		for (size_t i = first; i < last; ++i) {
+			if (!files[i].header.snapshot && files[i].header.generation < from)
+				continue;
+			int fd = ::open(files[i].path.c_str(), O_RDONLY);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(JournalHeader)) {
+				if (fd >= 0)
+					::close(fd);
+				continue;
+			}
+			void* m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (m == MAP_FAILED)
+				continue;
+			madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+			maps.push_back(std::make_pair((const char*)m, (size_t)st.st_size));
+		}
+		// a clear wipes everything before it, so skip to after the last one,
+		// and make room for the lobbies and players at once
+		size_t startmap = 0;
+		const char* startat = maps.empty() ? nullptr : maps[0].first + sizeof(JournalHeader);
+		size_t nlobbies = 0, nplayers = 0;
+		JournalRecord rec;
+		ReplayHint hint;
+		for (size_t m = 0; m < maps.size(); ++m) {
+			const char* p = maps[m].first + sizeof(JournalHeader);
+			const char* end = maps[m].first + maps[m].second;
+			while (nextrecord(p, end, rec)) {
+				if (rec.type == REC_WIPE) {
+					startmap = m;
+					startat = p;
+					nlobbies = nplayers = 0;
+				}
+				nlobbies += rec.type == REC_LOBBY;
+				nplayers += rec.type == REC_JOIN;
+			}
+		}
+		reg.reserve(nlobbies / (all ? workers : 1), nplayers / (all ? workers : 1));
+		for (size_t m = startmap; m < maps.size(); ++m) {
+			const char* p = m == startmap ? startat : maps[m].first + sizeof(JournalHeader);
+			const char* end = maps[m].first + maps[m].second;
+			while (nextrecord(p, end, rec)) {
+				if (rec.type == REC_WIPE || (all && (rec.nfields == 0 || shardof(rec.field[0], workers) != shard)))
+					continue;
+				applyrecord(reg, rec, hint);
+				++applied;
+			}
+		}
+		for (auto& m : maps)
+			munmap((void*)m.first, m.second);
+		first = last;
+	}
+	return applied;
+}
+
+// deletes what a restart with another number of workers left behind, once every worker
+// has written its snapshot of generation gen: older logs and snapshots of workers that are gone
+inline void removestale(const std::vector<JournalFile>& files, int workers, uint64_t gen) {
+	for (const JournalFile& f : files) {
+		if (f.header.snapshot ? f.header.shard >= (uint32_t)workers : f.header.generation < gen)
+			unlink(f.path.c_str());
+	}
+}
+
+// the log a worker appends its records to
+class Journal {
+public:
+	~Journal() { close(); }
+
+	bool enabled() const { return fd >= 0; }
+	uint64_t generation() const { return gen; }
+
+	// starts logging into a new log of generation g in d, false if it can't be created
+	bool open(const std::string& d, int s, int w, uint64_t g) {
+		dir = d;
+		shard = s;
+		workers = w;
+		return startlog(g);
+	}
+
+	// writes what is queued and stops logging, after the last snapshot is written
+	void close() {
+		writepending();
+		if (building) {
+			// a snapshot not built yet is dropped, the logs it would replace are kept
+			building = false;
+			body.clear();
+		}
+		if (writer.joinable())
+			writer.join();
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+
+	// queues a record, written by the next flush() or once JOURNALBUFFER bytes are queued
+	void log(char type, std::initializer_list<std::string_view> fields) {
+		if (fd < 0)
+			return;
+		appendrecord(pending, type, fields);
+		if (pending.size() >= JOURNALBUFFER)
+			writepending();
+	}
+
+	// writes the records queued so far, false if a write failed since the last flush
+	bool flush() {
+		writepending();
+		bool ok = !failed;
+		failed = false;
+		return ok;
+	}
+
+	// whether the log has grown enough to be replaced by a snapshot and no snapshot is being
+	// built or written
+	bool full() {
+		if (writer.joinable() && snapped.load(std::memory_order_acquire))
+			writer.join();
+		return fd >= 0 && !building && !writer.joinable() && written >= JOURNALLIMIT;
+	}
+
+	// starts the log of the next generation and a snapshot of reg as it is now, which step()
+	// builds over the next loop turns; with wait it is built and written before this returns
+	// false if the new log can't be created
+	bool snapshot(const Registry& reg, bool wait) {
+		if (fd < 0)
+			return false;
+		while (building)
+			step(reg);
+		if (writer.joinable())
+			writer.join();
+		flush();
+		if (!startlog(gen + 1))
+			return false;
+		JournalHeader h;
+		h.snapshot = 1;
+		h.shard = (uint32_t)shard;
+		h.workers = (uint32_t)workers;
+		h.generation = gen;
+		body.assign(1, std::string((const char*)&h, sizeof(h)));
+		builder.start();
+		building = true;
+		if (wait) {
+			builder.next(reg, body[0], SIZE_MAX);
+			building = false;
+			writesnapshot(body, gen);
+			body.clear();
+		}
+		return true;
+	}
+
+	// whether a snapshot is being built, the worker should come back to step() without sleeping
+	bool busy() const { return building; }
+
+	// builds SNAPSHOTSTEP more bytes of the snapshot, and hands it to the writer thread once
+	// it is whole; every step's bytes are a string of their own, so a step never copies the
+	// ones before it to grow
+	void step(const Registry& reg) {
+		if (!building)
+			return;
+		body.emplace_back();
+		body.back().reserve(SNAPSHOTSTEP + SNAPSHOTSTEP / 4);
+		if (!builder.next(reg, body.back(), SNAPSHOTSTEP))
+			return;
+		building = false;
+		snapped.store(false, std::memory_order_relaxed);
+		writer = std::thread([this, g = gen, b = std::move(body)]() {
+			writesnapshot(b, g);
+			snapped.store(true, std::memory_order_release);
+		});
+		body.clear();
+	}
+
+private:
+	void writepending() {
+		if (fd < 0 || pending.empty())
+			return;
+		if (!writeall(fd, pending.data(), pending.size()))
+			failed = true;
+		written += pending.size();
+		pending.clear();
+	}
+
+	static bool writeall(int f, const char* p, size_t n) {
+		while (n > 0) {
+			ssize_t k = ::write(f, p, n);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0)
+				return false;
+			p += k;
+			n -= (size_t)k;
+		}
+		return true;
+	}
+
+	bool startlog(uint64_t g) {
+		JournalHeader h;
+		h.shard = (uint32_t)shard;
+		h.workers = (uint32_t)workers;
+		h.generation = g;
+		int f = ::open(journalpath(dir, (uint32_t)shard, false, g).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		if (f < 0)
+			return false;
+		if (!writeall(f, (const char*)&h, sizeof(h))) {
+			::close(f);
+			return false;
+		}
+		if (fd >= 0)
+			::close(fd);
+		fd = f;
+		gen = g;
+		written = 0;
+		return true;
+	}
+
+	// the snapshot of generation g goes to a temporary file that is synced and then
+	// renamed over the old one, and only then are the logs it covers deleted
+	bool writesnapshot(const std::vector<std::string>& body, uint64_t g) {
+		std::string path = journalpath(dir, (uint32_t)shard, true, g);
+		std::string tmp = path + ".tmp";
+		int f = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (f < 0)
+			return false;
+		bool ok = true;
+		for (const std::string& part : body)
+			ok = ok && writeall(f, part.data(), part.size());
+		ok = ok && fsync(f) == 0;
+		::close(f);
+		if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+			unlink(tmp.c_str());
+			return false;
+		}
+		int d = ::open(dir.c_str(), O_RDONLY);
+		if (d >= 0) {
+			fsync(d);
+			::close(d);
+		}
+		std::vector<JournalFile> files;
+		if (!listjournals(dir, files))
+			return true;
+		for (const JournalFile& jf : files) {
+			if (jf.header.shard == (uint32_t)shard && !jf.header.snapshot && jf.header.generation < g)
+				unlink(jf.path.c_str());
+		}
+		return true;
+	}
+
+	std::string dir;
+	int shard = 0;
+	int workers = 1;
+	int fd = -1;
+	uint64_t gen = 0;
+	size_t written = 0;        // bytes in the current log
+	std::string pending;       // records not written yet
+	bool failed = false;       // a write failed since the last flush
+	SnapshotBuilder builder;
+	std::vector<std::string> body; // the snapshot being built, a part per step
+	bool building = false;
+	std::thread writer;        // writing the last snapshot
+	std::atomic<bool> snapped{false}; // the writer is done and can be joined
+};
+
+#else
+
+// the journal needs mmap and fsync, on Windows the masterserver runs without one
+inline bool listjournals(const std::string&, std::vector<JournalFile>& files) { files.clear(); return false; }
+inline size_t replayjournals(const std::vector<JournalFile>&, int, int, bool, Registry&) { return 0; }
+inline void removestale(const std::vector<JournalFile>&, int, uint64_t) {}
+class Journal {
+public:
+	bool enabled() const { return false; }
+	uint64_t generation() const { return 0; }
+	bool open(const std::string&, int, int, uint64_t) { return false; }
+	void close() {}
+	void log(char, std::initializer_list<std::string_view>) {}
+	bool flush() { return true; }
+	bool full() { return false; }
+	bool snapshot(const Registry&, bool) { return false; }
+	bool busy() const { return false; }
+	void step(const Registry&) {}
+};
+
+#endif
@@ -0,0 +1,230 @@
+// protocol.h : Parsing and dispatch of masterserver text packets.
+//
+// Packets look like "ccccc arg1:arg2:arg3", a 5 character command, a space,
+// then ':' separated arguments. parserequest() splits a received buffer into
+// string_views that point straight into it, so parsing never allocates.
+// Commands are packed into integers with cmdcode(), which also works in
+// constant expressions, and looked up in a DispatchTable that is built at
+// compile time.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define CMDLEN 5     // every command is 5 characters
+#define ARGSTART 6   // arguments start after the command and a space
+#define MAXFIELDS 24 // ':' separated arguments kept by parserequest()
+#define REPLYLEN 1024 // longest packet a Reply builds, the receive buffer size of the clients
+#define PAGELEN 508   // longest page of a paged listing, fits masterclient's 512 byte buffer
+
+// packs up to 5 command characters into an integer
+constexpr uint64_t cmdcode(std::string_view c) {
+	uint64_t v = 0;
+	for (size_t i = 0; i < CMDLEN && i < c.size(); ++i)
+		v |= (uint64_t)(unsigned char)c[i] << (8 * i);
+	return v;
+}
+
+// the command characters packed in code
+inline std::string cmdname(uint64_t code) {
+	std::string c;
+	for (; code != 0; code >>= 8)
+		c += (char)(code & 0xff);
+	return c;
+}
+
+// a parsed packet, every view points into the receive buffer
+struct Request {
+	uint64_t code = 0;
+	std::string_view command;              // [command]
+	std::string_view args;                 // [arg1]:[arg2]:[arg3]
+	std::string_view fields[MAXFIELDS];    // [arg1], [arg2], [arg3]
+	int nfields = 0;
+
+	// i-th argument, empty if it is missing (like getline on an exhausted stream)
+	std::string_view field(int i) const {
+		return i < nfields ? fields[i] : std::string_view();
+	}
+	// arguments from the i-th one to the end, e.g. the player list of a lobup
+	std::string_view rest(int i) const {
+		if (i >= nfields)
+			return std::string_view();
+		return args.substr(fields[i].data() - args.data());
+	}
+};
+
+// takes the next ':' separated field off the front of list
+inline std::string_view nextfield(std::string_view& list) {
+	size_t colon = list.find(':');
+	std::string_view f = list.substr(0, colon);
+	list = colon == std::string_view::npos ? std::string_view() : list.substr(colon + 1);
+	return f;
+}
+
+// splits the len bytes in buf into a Request without copying them
+// the arguments stop at the first NUL, as they did when read as a C string
+inline void parserequest(const char* buf, size_t len, Request& r) {
+	size_t clen = len < CMDLEN ? len : CMDLEN;
+	clen = strnlen(buf, clen);
+	r.command = std::string_view(buf, clen);
+	r.code = cmdcode(r.command);
+	r.args = len > ARGSTART ? std::string_view(buf + ARGSTART, strnlen(buf + ARGSTART, len - ARGSTART)) : std::string_view();
+	r.nfields = 0;
+	std::string_view list = r.args;
+	while (!list.empty() && r.nfields < MAXFIELDS)
+		r.fields[r.nfields++] = nextfield(list);
+}
+
+// Builds an outgoing packet in place, "ccccc arg1:arg2", without allocating.
+// Anything past REPLYLEN is dropped.
+class Reply {
+public:
+	explicit Reply(std::string_view command) { append(command); }
+
+	// adds the space after the command, so an empty list is sent as "psack "
+	Reply& open() {
+		if (!opened)
+			append(" ");
+		opened = true;
+		return *this;
+	}
+	// adds an argument, separated from the previous one by ':'
+	Reply& field(std::string_view f) {
+		if (nfields++ > 0)
+			append(":");
+		else
+			open();
+		append(f);
+		return *this;
+	}
+	const char* data() const { return buf; }
+	size_t size() const { return len; }
+	std::string_view str() const { return std::string_view(buf, len); }
+
+private:
+	void append(std::string_view t) {
+		size_t n = t.size() < REPLYLEN - len ? t.size() : REPLYLEN - len;
+		memcpy(buf + len, t.data(), n);
+		len += n;
+	}
+
+	char buf[REPLYLEN];
+	size_t len = 0;
+	int nfields = 0;
+	bool opened = false;
+};
+
+// value of a field holding a decimal number, 0 if it holds anything else
+inline uint32_t fieldnumber(std::string_view f) {
+	uint32_t n = 0;
+	for (char c : f) {
+		if (c < '0' || c > '9')
+			return 0;
+		n = n * 10 + (uint32_t)(c - '0');
+	}
+	return n;
+}
+
+// Splits a listing into pages of at most PAGELEN bytes,
+//   "ccccc key:version:page:pages:name1:name2..."
+// where page counts from 0 and the key (a region) is left out when it is
+// empty. version lets the client tell that the list changed while it was
+// fetching pages, it then starts over.
+inline void paginate(std::string_view command, std::string_view key, uint32_t version,
+	const std::vector<std::string_view>& names, std::vector<std::string>& pages) {
+	pages.clear();
+	std::string head(command);
+	head += ' ';
+	if (!key.empty())
+		head.append(key.data(), key.size()) += ':';
+	head += std::to_string(version) + ':';
+	// room for the names once page and pages are written, with 10 digits each
+	size_t room = PAGELEN > head.size() + 22 ? PAGELEN - head.size() - 22 : 0;
+	// first pass: which names go on which page
+	std::vector<size_t> first(1, 0);
+	size_t used = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		size_t n = names[i].size() + 1;
+		if (used > 0 && used + n > room) {
+			first.push_back(i);
+			used = 0;
+		}
+		used += n;
+	}
+	first.push_back(names.size());
+	size_t npages = first.size() - 1;
+	for (size_t p = 0; p < npages; ++p) {
+		std::string page = head + std::to_string(p) + ':' + std::to_string(npages);
+		for (size_t i = first[p]; i < first[p + 1]; ++i)
+			page.append(":").append(names[i].data(), names[i].size());
+		if (page.size() > PAGELEN)
+			page.resize(PAGELEN);
+		pages.push_back(page);
+	}
+}
+
+// one entry of a dispatch table
+template <typename H>
+struct Command {
+	uint64_t code;
+	H handler;
+};
+
+// Open-addressed table from command code to handler. It is filled in by a
+// constexpr constructor, so listing the same command twice fails to compile.
+template <typename H, size_t N>
+class DispatchTable {
+public:
+	static constexpr size_t SLOTS = 128;
+	static_assert(N * 2 <= SLOTS, "too many commands for the dispatch table");
+
+	constexpr DispatchTable(const Command<H>(&cmds)[N]) : codes{}, handlers{} {
+		for (size_t i = 0; i < N; ++i) {
+			size_t slot = home(cmds[i].code);
+			while (codes[slot] != 0) {
+				if (codes[slot] == cmds[i].code)
+					throw "command listed twice in dispatch table";
+				slot = (slot + 1) & (SLOTS - 1);
+			}
+			codes[slot] = cmds[i].code;
+			handlers[slot] = cmds[i].handler;
+		}
+	}
+
+	// handler for code, or nullptr if the command is unknown
+	H find(uint64_t code) const {
+		return handler(slot(code));
+	}
+
+	// slot of code, or SLOTS if the command is unknown
+	// slots number the commands, e.g. for counting packets per command
+	size_t slot(uint64_t code) const {
+		for (size_t slot = home(code); codes[slot] != 0; slot = (slot + 1) & (SLOTS - 1)) {
+			if (codes[slot] == code)
+				return slot;
+		}
+		return SLOTS;
+	}
+	// handler in slot, nullptr for SLOTS or an empty slot
+	H handler(size_t slot) const { return slot < SLOTS ? handlers[slot] : nullptr; }
+	// command code in slot, 0 for SLOTS or an empty slot
+	uint64_t code(size_t slot) const { return slot < SLOTS ? codes[slot] : 0; }
+
+private:
+	// multiplicative hash, the top 7 bits pick the slot
+	static constexpr size_t home(uint64_t code) {
+		return (size_t)((code * 0x9E3779B97F4A7C15ull) >> 57);
+	}
+
+	uint64_t codes[SLOTS];
+	H handlers[SLOTS];
+};
+
+template <typename H, size_t N>
+constexpr DispatchTable<H, N> makedispatch(const Command<H>(&cmds)[N]) {
+	return DispatchTable<H, N>(cmds);
+}
@@ -0,0 +1,91 @@
+// ratelimit.h : Token buckets that hold back sources sending more than their share.
+//
+// Every worker keeps one bucket per source address (ip and port, so players
+// behind one NAT don't share theirs) in a table of fixed size. The table is
+// set associative: a source hashes to a set of RATEWAYS buckets that fill one
+// cache line, and a source that has none of them takes the one used longest
+// ago, starting full, so the table never grows and a flood from many addresses
+// only pushes out the buckets of sources that were quiet.
+//
+// A bucket fills at rate tokens a second up to burst, and every request takes
+// the tokens its command costs. A request that finds too few is dropped before
+// it is parsed, so a flood costs a hash and a cache line per datagram.
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "metrics.h"
+#include "netio.h"
+
+#define RATESETS 16384 // sets of the table, a power of two
+#define RATEWAYS 4     // buckets in a set
+
+class RateLimiter {
+public:
+	RateLimiter() : sets(new Set[RATESETS]()), base(netclock::now()) {}
+
+	// tokens a source earns a second and most it can save, 0 turns the limiter off
+	void setrate(uint32_t r, uint32_t b) {
+		rate = (float)r;
+		burst = (float)(b > 0 ? b : r);
+	}
+	bool enabled() const { return rate > 0; }
+
+	// takes cost tokens from the bucket of source key, false if it has too few
+	bool take(uint64_t key, uint32_t cost, netclock::time_point now) {
+		uint32_t ms = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(now - base).count();
+		Set& set = sets[mix(key) & (RATESETS - 1)];
+		Bucket* b = nullptr;
+		Bucket* oldest = &set.ways[0];
+		for (Bucket& w : set.ways) {
+			if (w.key == key) {
+				b = &w;
+				break;
+			}
+			if (ms - w.stamp > ms - oldest->stamp)
+				oldest = &w;
+		}
+		if (b == nullptr) {
+			if (oldest->key != 0)
+				evicted.add();
+			b = oldest;
+			b->key = key;
+			b->tokens = burst;
+		}
+		else {
+			float tokens = b->tokens + (float)(ms - b->stamp) * rate / 1000.0f;
+			b->tokens = tokens < burst ? tokens : burst;
+		}
+		b->stamp = ms;
+		if (b->tokens < (float)cost)
+			return false;
+		b->tokens -= (float)cost;
+		return true;
+	}
+
+	// buckets taken from a source by a new one, the table is too small when this keeps growing
+	uint64_t evictions() const { return evicted.get(); }
+
+private:
+	struct Bucket {
+		uint64_t key = 0;     // ip and port, 0 for a bucket never used
+		uint32_t stamp = 0;   // when it was last filled, in ms since base
+		float tokens = 0;
+	};
+	struct alignas(64) Set {
+		Bucket ways[RATEWAYS];
+	};
+
+	static uint64_t mix(uint64_t k) {
+		k ^= k >> 33; k *= 0xff51afd7ed558ccdull;
+		k ^= k >> 33;
+		return k;
+	}
+
+	std::unique_ptr<Set[]> sets;
+	netclock::time_point base;
+	float rate = 0;
+	float burst = 0;
+	Counter evicted;
+};
@@ -0,0 +1,1151 @@
+// registry.h : Interned state of the masterserver.
+//
+// Regions, lobbies and players (SteamIDs) are interned to dense integer ids
+// and kept in slot arrays indexed by those ids, replacing the string keyed
+// maps that used "region:lobby" and "ip:port" strings. Lobby names are
+// interned per region, so "US:lobby1" is (id of US, "lobby1").
+//
+// Addresses are kept as Endpoints, a sockaddr_in that can be passed straight
+// to sendto() together with its "ip:port" text for messages. Reverse indexes
+// (player -> lobby, address -> server) make every lookup O(1), and removing
+// a lobby or player from a list is a swap with the last element.
+//
+// Servers and players expire when they haven't been heard from for their
+// lifetime. Hearing from one only stores the time; every server and player
+// has a timer in a wheel that, when it fires, is pushed back to the time last
+// heard plus the lifetime, or reports the entry dead. So a sweep only touches
+// the timers that are due, and reaping thousands at once costs that many.
+//
+// Every region keeps its lobbies that have a free slot in a binary heap, the
+// fullest one on top, for quick match. A lobby knows its place in the heap,
+// so a join, quit, reservation or close moves it in O(log n).
+//
+// Open servers are grouped by the host (machine) they run on, and every region
+// keeps its hosts in a second heap, the least loaded on top, so stlob puts a
+// new lobby on the host with the fewest lobbies, then the shortest tick and the
+// least CPU, instead of on the server that registered last.
+//
+// Lobbies whose server says their game mode and map (lbinf) are kept in a
+// search list of their region for the mode, one for the map and one for both,
+// each split into the lobbies with a free slot and the full ones. A join or
+// quit that fills or frees the last slot moves the lobby to the other half, a
+// swap like the lists above, so a search starts from the smallest list that
+// matches its mode and map exactly, and only checks the password and version.
+//
+// Presence queries look up a friend list at a time with findplayers(), which
+// hashes a group of names and prefetches their index buckets, then their
+// slots, before comparing any, so the cache misses of the group overlap
+// instead of following one another.
+//
+// Every lobby opened, closed or joined gives its region a new feed version,
+// and while someone subscribes to lobby lists the change is also kept in a
+// log the masterserver pushes to the subscribers and then empties.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "netio.h"
+#include "timerwheel.h"
+
+#define NOID 0xffffffffu // id of nothing, e.g. the lobby of a player who isn't in one
+#define LOBBYSLOTS 4     // players a lobby takes unless it says otherwise, as ClientManager.cs's maxConnections
+#define ATTRKINDS 3      // search lists a lobby is in: of its mode, of its map, and of both
+#define FINDGROUP 16     // names findmany() prefetches before probing any of them
+
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#define PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define PREFETCH(p) __builtin_prefetch(p)
+#endif
+
+// an address ready for sendto(), with its "ip:port" text
+struct Endpoint {
+	sockaddr_in addr;
+	char text[24];
+	uint8_t len = 0;
+
+	Endpoint() { memset(&addr, 0, sizeof(addr)); text[0] = '\0'; }
+	std::string_view str() const { return std::string_view(text, len); }
+	// ip and port packed together, used as the address index key
+	uint64_t key() const { return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port; }
+	bool valid() const { return len > 0; }
+};
+
+// writes v in decimal at p, returns the end
+inline char* writedecimal(char* p, unsigned v) {
+	char digits[10];
+	int n = 0;
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v != 0);
+	while (n > 0)
+		*p++ = digits[--n];
+	return p;
+}
+
+// endpoint of a, the text is written by hand since this runs for every packet received
+inline Endpoint makeendpoint(const sockaddr_in& a) {
+	Endpoint e;
+	e.addr = a;
+	const unsigned char* ip = (const unsigned char*)&a.sin_addr.s_addr;
+	char* p = e.text;
+	for (int i = 0; i < 4; ++i) {
+		p = writedecimal(p, ip[i]);
+		*p++ = i < 3 ? '.' : ':';
+	}
+	p = writedecimal(p, ntohs(a.sin_port));
+	*p = '\0';
+	e.len = (uint8_t)(p - e.text);
+	return e;
+}
+
+// endpoint from the text of an ip and a port, false if either is malformed
+inline bool makeendpoint(std::string_view ip, std::string_view port, Endpoint& e) {
+	char ipbuf[16];
+	if (ip.empty() || ip.size() >= sizeof(ipbuf) || port.empty() || port.size() > 5)
+		return false;
+	unsigned p = 0;
+	for (char c : port) {
+		if (c < '0' || c > '9')
+			return false;
+		p = p * 10 + (c - '0');
+	}
+	if (p > 65535)
+		return false;
+	memcpy(ipbuf, ip.data(), ip.size());
+	ipbuf[ip.size()] = '\0';
+	sockaddr_in a;
+	setaddr(a, ipbuf, (unsigned short)p);
+	if (a.sin_addr.s_addr == INADDR_NONE && ip != "255.255.255.255")
+		return false;
+	e = makeendpoint(a);
+	return true;
+}
+
+// Interns (scope, name) pairs to dense ids. Ids of released names are reused.
+// The index is open addressed with linear probing, like TxTable's, so a
+// lookup with a string_view never allocates.
+class NameTable {
+public:
+	NameTable() { index.assign(16, Bucket()); }
+
+	// id of (scope, name), or NOID
+	uint32_t find(uint32_t scope, std::string_view name) const {
+		return probe(scope, name, hash(scope, name));
+	}
+
+	// find() of every keys[k], k < n, into ids[k]; a group of FINDGROUP is hashed and has its
+	// buckets prefetched, then the ids they hold and their names, before any name is compared
+	void findmany(uint32_t scope, const std::string_view* keys, int n, uint32_t* ids) const {
+		uint64_t hs[FINDGROUP];
+		size_t mask = index.size() - 1;
+		for (int first = 0; first < n; first += FINDGROUP) {
+			int m = n - first < FINDGROUP ? n - first : FINDGROUP;
+			for (int k = 0; k < m; ++k) {
+				hs[k] = hash(scope, keys[first + k]);
+				PREFETCH(&index[hs[k] & mask]);
+			}
+			// the first id with the same hash is almost always the name
+			for (int k = 0; k < m; ++k) {
+				uint32_t id = NOID;
+				for (size_t b = hs[k] & mask; index[b].id != NOID; b = (b + 1) & mask) {
+					if (index[b].hash == hs[k]) {
+						id = index[b].id;
+						break;
+					}
+				}
+				ids[first + k] = id;
+				if (id != NOID) {
+					PREFETCH(&names[id]);
+					PREFETCH(&scopes[id]);
+				}
+			}
+			for (int k = 0; k < m; ++k) {
+				uint32_t id = ids[first + k];
+				if (id != NOID && (scopes[id] != scope || names[id] != keys[first + k]))
+					ids[first + k] = probe(scope, keys[first + k], hs[k]);
+			}
+		}
+	}
+
+	// id of (scope, name), adding it if it is new
+	uint32_t intern(uint32_t scope, std::string_view name) {
+		uint32_t id = find(scope, name);
+		if (id != NOID)
+			return id;
+		if ((count + 1) * 2 > index.size())
+			grow();
+		if (!freeids.empty()) {
+			id = freeids.back();
+			freeids.pop_back();
+		}
+		else {
+			id = (uint32_t)names.size();
+			names.emplace_back();
+			scopes.push_back(0);
+			hashes.push_back(0);
+		}
+		names[id] = name;
+		scopes[id] = scope;
+		hashes[id] = hash(scope, name);
+		place(hashes[id], id);
+		++count;
+		return id;
+	}
+
+	// forgets id, it may be handed out again by intern()
+	void release(uint32_t id) {
+		if (!inuse(id))
+			return;
+		size_t mask = index.size() - 1;
+		size_t b = hashes[id] & mask;
+		while (index[b].id != id)
+			b = (b + 1) & mask;
+		// backward shift deletion, see TxTable::erase
+		size_t next = b;
+		for (;;) {
+			next = (next + 1) & mask;
+			if (index[next].id == NOID)
+				break;
+			size_t home = index[next].hash & mask;
+			bool stays = b <= next ? (b < home && home <= next) : (b < home || home <= next);
+			if (stays)
+				continue;
+			index[b] = index[next];
+			b = next;
+		}
+		index[b] = Bucket();
+		names[id].clear();
+		names[id].shrink_to_fit();
+		scopes[id] = NOID;
+		freeids.push_back(id);
+		--count;
+	}
+
+	// makes room for n names without growing the index again
+	void reserve(size_t n) {
+		names.reserve(n);
+		scopes.reserve(n);
+		hashes.reserve(n);
+		size_t size = index.size();
+		while (size < n * 2)
+			size *= 2;
+		if (size > index.size())
+			rehash(size);
+	}
+
+	void clear() {
+		names.clear();
+		scopes.clear();
+		hashes.clear();
+		freeids.clear();
+		index.assign(16, Bucket());
+		count = 0;
+	}
+
+	std::string_view name(uint32_t id) const { return names[id]; }
+	uint32_t scope(uint32_t id) const { return scopes[id]; }
+	bool inuse(uint32_t id) const { return id < scopes.size() && scopes[id] != NOID; }
+	// every id in use is below capacity()
+	uint32_t capacity() const { return (uint32_t)names.size(); }
+	size_t size() const { return count; }
+
+	// heap bytes used by the names and the index
+	size_t bytes() const {
+		size_t n = names.capacity() * sizeof(std::string) + scopes.capacity() * sizeof(uint32_t)
+			+ hashes.capacity() * sizeof(uint64_t) + freeids.capacity() * sizeof(uint32_t)
+			+ index.capacity() * sizeof(Bucket);
+		for (const std::string& s : names)
+			if (s.capacity() > 15) // longer names are out of line, shorter ones are in the string
+				n += s.capacity() + 1;
+		return n;
+	}
+
+private:
+	struct Bucket {
+		uint64_t hash = 0;
+		uint32_t id = NOID;
+	};
+
+	uint32_t probe(uint32_t scope, std::string_view name, uint64_t h) const {
+		size_t mask = index.size() - 1;
+		for (size_t b = h & mask; index[b].id != NOID; b = (b + 1) & mask) {
+			uint32_t id = index[b].id;
+			if (index[b].hash == h && scopes[id] == scope && names[id] == name)
+				return id;
+		}
+		return NOID;
+	}
+
+	// FNV-1a over the scope then the name, with the same final mix as TxTable
+	static uint64_t hash(uint32_t scope, std::string_view name) {
+		uint64_t h = 14695981039346656037ull;
+		for (int i = 0; i < 4; ++i) { h ^= (scope >> (8 * i)) & 0xff; h *= 1099511628211ull; }
+		for (char c : name) { h ^= (unsigned char)c; h *= 1099511628211ull; }
+		h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	void place(uint64_t h, uint32_t id) {
+		size_t mask = index.size() - 1;
+		size_t b = h & mask;
+		while (index[b].id != NOID)
+			b = (b + 1) & mask;
+		index[b].hash = h;
+		index[b].id = id;
+	}
+
+	void grow() { rehash(index.size() * 2); }
+
+	void rehash(size_t size) {
+		index.assign(size, Bucket());
+		for (uint32_t id = 0; id < names.size(); ++id)
+			if (inuse(id))
+				place(hashes[id], id);
+	}
+
+	std::vector<std::string> names;
+	std::vector<uint32_t> scopes; // NOID marks a free id
+	std::vector<uint64_t> hashes;
+	std::vector<uint32_t> freeids;
+	std::vector<Bucket> index;
+	size_t count = 0;
+};
+
+// sizes of the registry, for capacity planning
+struct RegistryStats {
+	size_t regions = 0;
+	size_t lobbies = 0;
+	size_t servers = 0;        // registered game servers, open or hosting a lobby
+	size_t players = 0;
+	size_t bytes = 0;          // heap and slot array bytes of the whole registry
+	size_t bytesperlobby = 0;  // lobby slot, name, index share and player list
+	size_t bytesperplayer = 0; // player slot, name and index share
+};
+
+class Registry {
+public:
+	struct Region {
+		std::vector<uint32_t> lobbies; // lobbies in the region, the order lobby lists are sent in
+		std::vector<uint32_t> open;    // open servers (without a lobby) waiting for a stlob
+		bool listed = false;           // shown in server lists, cleared when the last lobby closes
+		std::string lobbylist;         // cached reply listing the lobbies, emptied when they change
+		std::vector<std::string> lobbypages; // cached pages of the same list, emptied with it
+		uint32_t version = 0;          // changes whenever the lobbies do, for paged listings
+		std::vector<uint32_t> joinable; // heap of the lobbies with a free slot, best for quick match first
+		std::vector<uint32_t> hosts;   // heap of the hosts with open servers, least loaded first
+		uint32_t feed = 0;             // changes whenever a lobby opens, closes or is joined or left
+	};
+	struct Lobby {
+		uint32_t region = NOID;
+		uint32_t pos = 0;              // index in Region::lobbies
+		Endpoint server;               // game server hosting the lobby
+		std::vector<uint32_t> players;
+		uint32_t attrs[ATTRKINDS] = { NOID, NOID, NOID }; // search lists of its mode, map and both, NOID if not said
+		uint32_t attrpos[ATTRKINDS] = { 0, 0, 0 };        // index in each
+		bool password = false;         // players need a password to join
+		uint32_t version = 0;          // of the game the server runs
+		uint32_t slots = 0;            // most players the lobby takes
+		uint32_t reserved = 0;         // slots held for players whose pjoin the server hasn't ACKed yet
+		uint32_t heappos = NOID;       // index in Region::joinable, NOID while the lobby is full
+	};
+	struct Player {
+		Endpoint addr;                 // last address the player sent from
+		uint32_t lobby = NOID;         // current game
+		uint32_t pos = 0;              // index in Lobby::players
+		std::string game;              // "region:lobby" of a current game kept by another worker
+		uint32_t quick = NOID;         // lobby the last pquik sent the player to
+		netclock::time_point seen;     // last heard from
+	};
+	struct Server {
+		uint32_t region = NOID;
+		uint32_t lobby = NOID;         // NOID while the server is open
+		uint32_t pos = 0;              // index in Region::open while open
+		uint32_t host = NOID;          // host it runs on while open
+		uint32_t hostpos = 0;          // index in Host::open while open
+		Endpoint addr;
+		netclock::time_point seen;     // last heard from, its lobby lives as long as it does
+	};
+	// load of a host as its servers report it in stser and lobup
+	struct Load {
+		uint32_t cpu = 0;              // percent
+		uint32_t tick = 0;             // microseconds a server frame takes
+		uint32_t lobbies = 0;          // lobbies running on the host
+	};
+	// a lobby that opened ('a'), closed ('c') or whose players changed ('n'), for subscribers
+	struct LobbyChange {
+		char op;
+		uint32_t prev;                 // feed version of the region before the change
+		uint32_t feed;                 // and after it
+		std::string region;
+		std::string lobby;
+		uint32_t players;
+		uint32_t slots;
+	};
+	// the lobbies of a search list, by whether they have a free slot
+	struct AttrList {
+		std::vector<uint32_t> lobbies[2]; // [0] with a free slot, [1] full
+	};
+	// what a lobby search looks for, empty or 0 for anything
+	struct LobbyQuery {
+		std::string_view mode;
+		std::string_view map;
+		bool free = false;             // only lobbies with a free slot
+		int password = -1;             // 0 without a password, 1 with one
+		uint32_t version = 0;
+		char sort = 0;                 // 'p' most players, 'f' most free slots, 's' most slots first
+	};
+	// a machine running game servers of a region, kept while it has open servers
+	struct Host {
+		std::vector<uint32_t> open;    // its open servers, the one registered last at the back
+		Load load;                     // as last reported, plus the lobbies placed on it since
+		uint32_t heappos = NOID;       // index in Region::hosts
+	};
+
+	//////////////
+	// REGIONS //
+	/////////////
+
+	uint32_t findregion(std::string_view name) const { return regionnames.find(0, name); }
+	// region that is shown in server lists, NOID if there is none by that name
+	uint32_t listedregion(std::string_view name) const {
+		uint32_t r = findregion(name);
+		return r != NOID && regions[r].listed ? r : NOID;
+	}
+	// adds region to the server lists
+	uint32_t addregion(std::string_view name) {
+		uint32_t r = regionnames.intern(0, name);
+		fit(regions, r);
+		regions[r].listed = true;
+		return r;
+	}
+	// takes region r off the server lists, forgetting it if it has no lobbies or open servers
+	void unlistregion(uint32_t r) {
+		regions[r].listed = false;
+		releaseregion(r);
+	}
+	std::string_view regionname(uint32_t r) const { return regionnames.name(r); }
+	const Region& region(uint32_t r) const { return regions[r]; }
+	// the cached lobby list reply of region r, empty after its lobbies changed
+	std::string& lobbylist(uint32_t r) { return regions[r].lobbylist; }
+	// the cached pages of that list, empty after its lobbies changed
+	std::vector<std::string>& lobbypages(uint32_t r) { return regions[r].lobbypages; }
+	// ids of every region, listed or not, iterate 0..regioncapacity()-1 and skip the ones not inuse
+	uint32_t regioncapacity() const { return regionnames.capacity(); }
+	bool regioninuse(uint32_t r) const { return regionnames.inuse(r); }
+
+	//////////////
+	// SERVERS //
+	/////////////
+
+	// server registered at addr, NOID if none
+	uint32_t findserver(const Endpoint& addr) const {
+		auto it = serverbyaddr.find(addr.key());
+		return it == serverbyaddr.end() ? NOID : it->second;
+	}
+	const Server& server(uint32_t sv) const { return servers[sv]; }
+	// registers addr as an open server of region r running on host hostname (its ip if empty)
+	uint32_t addopenserver(uint32_t r, const Endpoint& addr, std::string_view hostname = {}) {
+		uint32_t sv = newserver(r, addr);
+		servers[sv].pos = (uint32_t)regions[r].open.size();
+		regions[r].open.push_back(sv);
+		uint32_t h = hostnames.intern(r, hostof(hostname, addr));
+		fit(hosts, h);
+		servers[sv].host = h;
+		servers[sv].hostpos = (uint32_t)hosts[h].open.size();
+		hosts[h].open.push_back(sv);
+		if (hosts[h].heappos == NOID)
+			heapupdate(regions[r].hosts, h, hosts, &Host::heappos, Lighter{ this });
+		return sv;
+	}
+	// forgets open server sv, and its region if it has no lobbies or open servers left
+	void removeserver(uint32_t sv) {
+		uint32_t r = servers[sv].region;
+		freeserver(sv);
+		if (r != NOID && regions[r].lobbies.empty() && regions[r].open.empty()) {
+			regions[r].listed = false;
+			releaseregion(r);
+		}
+	}
+	// takes the most recently registered open server of the least loaded host of region r
+	// off the open lists and forgets it, counting the lobby it is about to get against its
+	// host, returns false if the region has none
+	bool takeopenserver(uint32_t r, Endpoint& addr) {
+		if (r == NOID || regions[r].hosts.empty())
+			return false;
+		uint32_t h = regions[r].hosts[0];
+		uint32_t sv = hosts[h].open.back();
+		++hosts[h].load.lobbies;
+		addr = servers[sv].addr;
+		freeserver(sv);
+		releaseregion(r);
+		return true;
+	}
+	// the load host hostname (the ip of addr if empty) of region r reported, ignored if the
+	// host has no open servers there
+	void setload(uint32_t r, std::string_view hostname, const Endpoint& addr, const Load& load) {
+		uint32_t h = r == NOID ? NOID : hostnames.find(r, hostof(hostname, addr));
+		if (h == NOID)
+			return;
+		hosts[h].load = load;
+		heapupdate(regions[r].hosts, h, hosts, &Host::heappos, Lighter{ this });
+	}
+	std::string_view hostname(uint32_t h) const { return hostnames.name(h); }
+	const Host& host(uint32_t h) const { return hosts[h]; }
+
+	//////////////
+	// LOBBIES //
+	/////////////
+
+	uint32_t findlobby(uint32_t r, std::string_view name) const {
+		return r == NOID ? NOID : lobbynames.find(r, name);
+	}
+	// starts lobby name in region r, hosted by the server at addr, taking slots players
+	// (0 for the default); NOID if that server hosts another lobby already
+	uint32_t addlobby(uint32_t r, std::string_view name, const Endpoint& addr, uint32_t slots = 0) {
+		uint32_t l = lobbynames.find(r, name);
+		if (l != NOID)
+			return l;
+		uint32_t sv = findserver(addr);
+		if (sv != NOID && servers[sv].lobby != NOID)
+			return NOID;
+		l = lobbynames.intern(r, name);
+		fit(lobbies, l);
+		Lobby& lb = lobbies[l];
+		lb.region = r;
+		lb.pos = (uint32_t)regions[r].lobbies.size();
+		lb.server = addr;
+		lb.slots = slots > 0 ? slots : lobbyslots;
+		regions[r].lobbies.push_back(l);
+		lobbieschanged(r);
+		filled(l);
+		feedchange(l, 'a');
+		if (sv == NOID)
+			sv = newserver(r, addr);
+		else if (servers[sv].lobby == NOID)
+			unopen(sv);
+		servers[sv].region = r;
+		servers[sv].lobby = l;
+		servers[sv].seen = netclock::now();
+		return l;
+	}
+	// closes lobby l, its players are left without a current game
+	// the region leaves the server lists when its last lobby closes
+	void removelobby(uint32_t l) {
+		feedchange(l, 'c');
+		Lobby& lb = lobbies[l];
+		for (uint32_t p : lb.players)
+			players[p].lobby = NOID;
+		uint32_t sv = findserver(lb.server);
+		if (sv != NOID && servers[sv].lobby == l)
+			freeserver(sv);
+		uint32_t r = lb.region;
+		unindex(l);
+		if (lb.heappos != NOID)
+			heapremove(regions[r].joinable, lb.heappos, lobbies, &Lobby::heappos, Fuller{ this });
+		swapremove(regions[r].lobbies, lb.pos, lobbies, &Lobby::pos);
+		lobbieschanged(r);
+		lb = Lobby();
+		lobbynames.release(l);
+		if (regions[r].lobbies.empty()) {
+			regions[r].listed = false;
+			releaseregion(r);
+		}
+	}
+	std::string_view lobbyname(uint32_t l) const { return lobbynames.name(l); }
+	const Lobby& lobby(uint32_t l) const { return lobbies[l]; }
+	// whether the server of lobby l gave its attributes
+	bool described(uint32_t l) const {
+		const Lobby& lb = lobbies[l];
+		return lb.attrs[0] != NOID || lb.attrs[1] != NOID || lb.password || lb.version != 0;
+	}
+	// game mode and map of lobby l, empty if its server didn't say
+	std::string_view lobbymode(uint32_t l) const { return attrvalue(lobbies[l].attrs[0]); }
+	std::string_view lobbymap(uint32_t l) const { return attrvalue(lobbies[l].attrs[1]); }
+	// the attributes the server of lobby l gives, moving it to the search lists of its mode and map
+	void setattributes(uint32_t l, std::string_view mode, std::string_view map, bool password, uint32_t version) {
+		Lobby& lb = lobbies[l];
+		lb.password = password;
+		lb.version = version;
+		if (lobbymode(l) == mode && lobbymap(l) == map)
+			return;
+		unindex(l);
+		std::string key;
+		for (int k = 0; k < ATTRKINDS; ++k) {
+			key.assign(1, "mpb"[k]);
+			if (k == 0 || k == 2)
+				key.append(mode);
+			if (k == 2)
+				key.append(":");
+			if (k == 1 || k == 2)
+				key.append(map);
+			if ((k != 1 && mode.empty()) || (k != 0 && map.empty()))
+				continue;
+			uint32_t a = attrnames.intern(lb.region, key);
+			fit(attrlists, a);
+			std::vector<uint32_t>& list = attrlists[a].lobbies[lb.heappos == NOID];
+			lb.attrs[k] = a;
+			lb.attrpos[k] = (uint32_t)list.size();
+			list.push_back(l);
+		}
+	}
+	// the first want lobbies of region r matching q, in q's order, into out, returns how many
+	// matched; starts from the smallest list that has them all
+	size_t search(uint32_t r, const LobbyQuery& q, size_t want, std::vector<uint32_t>& out) const {
+		out.clear();
+		ranked.clear();
+		if (r == NOID)
+			return 0;
+		// the search list of the mode, the map or both, or every lobby of the region if neither is given
+		const std::vector<uint32_t>* lists[2] = { nullptr, nullptr };
+		if (!q.mode.empty() || !q.map.empty()) {
+			std::string key(1, q.mode.empty() ? 'p' : q.map.empty() ? 'm' : 'b');
+			key.append(q.mode);
+			if (!q.mode.empty() && !q.map.empty())
+				key.append(":");
+			key.append(q.map);
+			uint32_t a = attrnames.find(r, key);
+			if (a == NOID)
+				return 0;
+			lists[0] = &attrlists[a].lobbies[0];
+			if (!q.free)
+				lists[1] = &attrlists[a].lobbies[1];
+		}
+		else {
+			lists[0] = q.free ? &regions[r].joinable : &regions[r].lobbies;
+		}
+		// sorted, a lobby is ranked by its key inverted above its id, so the order is an integer one
+		size_t matches = 0;
+		for (const std::vector<uint32_t>* list : lists) {
+			if (list == nullptr)
+				continue;
+			for (uint32_t l : *list) {
+				const Lobby& lb = lobbies[l];
+				if ((q.password >= 0 && lb.password != (q.password > 0)) || (q.version != 0 && lb.version != q.version))
+					continue;
+				++matches;
+				if (q.sort == 0) {
+					if (out.size() < want)
+						out.push_back(l);
+					continue;
+				}
+				uint32_t key = q.sort == 'p' ? (uint32_t)lb.players.size()
+					: q.sort == 'f' ? lb.slots - std::min(taken(l), lb.slots) : lb.slots;
+				ranked.push_back((uint64_t)~key << 32 | l);
+			}
+		}
+		if (q.sort != 0) {
+			size_t n = std::min(want, ranked.size());
+			std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end());
+			for (size_t i = 0; i < n; ++i)
+				out.push_back((uint32_t)ranked[i]);
+		}
+		return matches;
+	}
+	uint32_t lobbycapacity() const { return lobbynames.capacity(); }
+	bool lobbyinuse(uint32_t l) const { return lobbynames.inuse(l); }
+
+	//////////////////
+	// QUICK MATCH //
+	/////////////////
+
+	// players that lobbies take when they don't say
+	void setlobbyslots(uint32_t slots) { lobbyslots = slots; }
+	// the lobby of region r a quick match puts a player in, NOID if every lobby is full:
+	// the fullest by share of its slots, then the one with fewer slots left
+	uint32_t quickmatch(uint32_t r) const {
+		return r == NOID || regions[r].joinable.empty() ? NOID : regions[r].joinable[0];
+	}
+	// holds a slot of lobby l for a player on their way in, until join() or releaseslot()
+	void reserveslot(uint32_t l) {
+		++lobbies[l].reserved;
+		filled(l);
+	}
+	void releaseslot(uint32_t l) {
+		if (lobbies[l].reserved == 0)
+			return;
+		--lobbies[l].reserved;
+		filled(l);
+	}
+
+	//////////////
+	// PLAYERS //
+	/////////////
+
+	uint32_t findplayer(std::string_view steamid) const { return playernames.find(0, steamid); }
+	// findplayer() of n SteamIDs at once, prefetching the slots of those found
+	void findplayers(const std::string_view* steamids, int n, uint32_t* ids) const {
+		playernames.findmany(0, steamids, n, ids);
+		for (int k = 0; k < n; ++k) {
+			if (ids[k] != NOID)
+				PREFETCH(&players[ids[k]]);
+		}
+	}
+	// player steamid, adding them if they are new
+	uint32_t addplayer(std::string_view steamid) {
+		size_t known = playernames.size();
+		uint32_t p = playernames.intern(0, steamid);
+		fit(players, p);
+		if (playernames.size() != known) {
+			players[p].seen = netclock::now();
+			playerexpiry.arm(p, players[p].seen + playerlife);
+		}
+		return p;
+	}
+	// remembers the address steamid sends from, which also means they were heard from
+	uint32_t setplayeraddr(std::string_view steamid, const Endpoint& addr) {
+		uint32_t p = addplayer(steamid);
+		players[p].addr = addr;
+		players[p].seen = netclock::now();
+		return p;
+	}
+	// remembers that a pquik sent player p to lobby l, so a retry goes to the same lobby
+	void setquick(uint32_t p, uint32_t l) { players[p].quick = l; }
+	// forgets player p, who should be in no game
+	void removeplayer(uint32_t p) {
+		leave(p);
+		playerexpiry.cancel(p);
+		players[p] = Player();
+		playernames.release(p);
+	}
+	// records that player p is in a game kept by another worker, an empty region clears it
+	void setremotegame(uint32_t p, std::string_view region, std::string_view lobby) {
+		players[p].game.clear();
+		if (region.empty())
+			return;
+		players[p].game.append(region).append(":").append(lobby);
+	}
+	// puts player p in lobby l, taking them out of their previous game
+	void join(uint32_t p, uint32_t l) {
+		if (players[p].lobby == l)
+			return;
+		leave(p);
+		players[p].game.clear();
+		players[p].lobby = l;
+		players[p].pos = (uint32_t)lobbies[l].players.size();
+		lobbies[l].players.push_back(p);
+		filled(l);
+		feedchange(l, 'n');
+	}
+	// takes player p out of their current game
+	void leave(uint32_t p) {
+		uint32_t l = players[p].lobby;
+		if (l == NOID)
+			return;
+		swapremove(lobbies[l].players, players[p].pos, players, &Player::pos);
+		players[p].lobby = NOID;
+		filled(l);
+		feedchange(l, 'n');
+	}
+	std::string_view playername(uint32_t p) const { return playernames.name(p); }
+	const Player& player(uint32_t p) const { return players[p]; }
+	uint32_t playercapacity() const { return playernames.capacity(); }
+	bool playerinuse(uint32_t p) const { return playernames.inuse(p); }
+
+	// keep the changes subscribers are sent, or stop when nobody subscribes
+	void recordchanges(bool on) {
+		recording = on;
+		if (!on)
+			feedlog.clear();
+	}
+	// the changes since they were last taken, oldest first, for the caller to empty
+	std::vector<LobbyChange>& changelog() { return feedlog; }
+
+	// makes room for this many lobbies and players, e.g. before loading a snapshot
+	void reserve(size_t nlobbies, size_t nplayers) {
+		lobbynames.reserve(nlobbies);
+		lobbies.reserve(nlobbies);
+		servers.reserve(nlobbies);
+		serverbyaddr.reserve(nlobbies);
+		playernames.reserve(nplayers);
+		players.reserve(nplayers);
+	}
+
+	/////////////
+	// EXPIRY //
+	/////////////
+
+	// how long servers (with their lobbies) and players are kept after they were last heard from
+	void setlifetimes(netclock::duration server, netclock::duration player) {
+		serverlife = server;
+		playerlife = player;
+	}
+	// server sv or player p was heard from
+	void seenserver(uint32_t sv) { servers[sv].seen = netclock::now(); }
+	void seenplayer(uint32_t p) { players[p].seen = netclock::now(); }
+	// every server and player was heard from just now, when a standby that only followed them takes over
+	void seeneveryone() {
+		netclock::time_point now = netclock::now();
+		for (Server& sv : servers)
+			sv.seen = now;
+		for (Player& pl : players)
+			pl.seen = now;
+	}
+	// earliest time expire() may have work to do, false if nothing can expire
+	bool nextexpiry(netclock::time_point& when) const {
+		netclock::time_point s, p;
+		bool hasserver = serverexpiry.nextexpiry(s), hasplayer = playerexpiry.nextexpiry(p);
+		if (!hasserver && !hasplayer)
+			return false;
+		when = !hasplayer || (hasserver && s < p) ? s : p;
+		return true;
+	}
+	// calls deadserver(sv) for every server and deadplayer(p) for every player that hasn't
+	// been heard from for its lifetime at now, which should remove them (removelobby or
+	// removeserver, removeplayer); players in a game are kept until it ends
+	template <typename S, typename P>
+	void expire(netclock::time_point now, S deadserver, P deadplayer) {
+		serverexpiry.advance(now, [&](uint32_t sv) {
+			netclock::time_point due = servers[sv].seen + serverlife;
+			if (due > now)
+				serverexpiry.arm(sv, due);
+			else
+				deadserver(sv);
+		});
+		playerexpiry.advance(now, [&](uint32_t p) {
+			const Player& pl = players[p];
+			netclock::time_point due = pl.seen + playerlife;
+			if (due > now)
+				playerexpiry.arm(p, due);
+			else if (pl.lobby != NOID || !pl.game.empty())
+				playerexpiry.arm(p, now + playerlife);
+			else
+				deadplayer(p);
+		});
+	}
+
+	void clear() {
+		regionnames.clear();
+		lobbynames.clear();
+		playernames.clear();
+		regions.clear();
+		lobbies.clear();
+		players.clear();
+		servers.clear();
+		freeservers.clear();
+		hostnames.clear();
+		hosts.clear();
+		attrnames.clear();
+		attrlists.clear();
+		feedlog.clear();
+		serverbyaddr.clear();
+		serverexpiry.clear();
+		playerexpiry.clear();
+		changes = 0;
+	}
+
+	RegistryStats stats() const {
+		RegistryStats st;
+		st.regions = regionnames.size();
+		st.lobbies = lobbynames.size();
+		st.players = playernames.size();
+		st.servers = serverbyaddr.size();
+		size_t lobbyheap = 0, regionheap = 0;
+		for (const Lobby& lb : lobbies)
+			lobbyheap += lb.players.capacity() * sizeof(uint32_t);
+		lobbyheap += attrnames.bytes() + attrlists.capacity() * sizeof(AttrList);
+		for (const AttrList& list : attrlists)
+			lobbyheap += (list.lobbies[0].capacity() + list.lobbies[1].capacity()) * sizeof(uint32_t);
+		for (const Region& rg : regions) {
+			regionheap += (rg.lobbies.capacity() + rg.open.capacity() + rg.joinable.capacity() + rg.hosts.capacity()) * sizeof(uint32_t)
+				+ (rg.lobbylist.capacity() > 15 ? rg.lobbylist.capacity() + 1 : 0)
+				+ rg.lobbypages.capacity() * sizeof(std::string);
+			for (const std::string& page : rg.lobbypages)
+				regionheap += page.capacity() + 1;
+		}
+		size_t lobbybytes = lobbies.capacity() * sizeof(Lobby) + lobbyheap + lobbynames.bytes();
+		size_t playerbytes = players.capacity() * sizeof(Player) + playernames.bytes();
+		for (const Player& pl : players)
+			playerbytes += pl.game.capacity() > 15 ? pl.game.capacity() + 1 : 0;
+		// an unordered_map node holds the pair, a next pointer and the cached hash
+		size_t serverbytes = servers.capacity() * sizeof(Server) + freeservers.capacity() * sizeof(uint32_t)
+			+ hosts.capacity() * sizeof(Host) + hostnames.bytes()
+			+ serverbyaddr.size() * (sizeof(std::pair<const uint64_t, uint32_t>) + 2 * sizeof(void*))
+			+ serverbyaddr.bucket_count() * sizeof(void*);
+		st.bytes = lobbybytes + playerbytes + serverbytes + regionheap
+			+ regions.capacity() * sizeof(Region) + regionnames.bytes();
+		st.bytesperlobby = st.lobbies ? lobbybytes / st.lobbies : 0;
+		st.bytesperplayer = st.players ? playerbytes / st.players : 0;
+		return st;
+	}
+
+private:
+	template <typename T>
+	static void fit(std::vector<T>& v, uint32_t id) {
+		if (id >= v.size())
+			v.resize(id + 1);
+	}
+
+	// removes list[pos] by moving the last element into it and fixing that element's stored position
+	template <typename T>
+	static void swapremove(std::vector<uint32_t>& list, uint32_t pos, std::vector<T>& owners, uint32_t T::*posof) {
+		uint32_t last = list.back();
+		list[pos] = last;
+		owners[last].*posof = pos;
+		list.pop_back();
+	}
+
+	// drops region r's cached lists and gives it a version no other list had
+	void lobbieschanged(uint32_t r) {
+		regions[r].lobbylist.clear();
+		regions[r].lobbypages.clear();
+		regions[r].version = ++changes;
+	}
+
+	// Binary heaps of ids whose owners store their index in the heap, like swapremove's lists.
+	// first(a, b) says whether a belongs above b.
+
+	// moves heap[pos] up while it belongs above its parent, returns where it ended up
+	template <typename T, typename F>
+	static uint32_t siftup(std::vector<uint32_t>& heap, uint32_t pos, std::vector<T>& owners, uint32_t T::*posof, F first) {
+		uint32_t id = heap[pos];
+		while (pos > 0) {
+			uint32_t parent = (pos - 1) / 2;
+			if (!first(id, heap[parent]))
+				break;
+			heap[pos] = heap[parent];
+			owners[heap[pos]].*posof = pos;
+			pos = parent;
+		}
+		heap[pos] = id;
+		owners[id].*posof = pos;
+		return pos;
+	}
+
+	// moves heap[pos] down while a child belongs above it
+	template <typename T, typename F>
+	static void siftdown(std::vector<uint32_t>& heap, uint32_t pos, std::vector<T>& owners, uint32_t T::*posof, F first) {
+		uint32_t id = heap[pos], n = (uint32_t)heap.size();
+		for (;;) {
+			uint32_t child = 2 * pos + 1;
+			if (child >= n)
+				break;
+			if (child + 1 < n && first(heap[child + 1], heap[child]))
+				++child;
+			if (!first(heap[child], id))
+				break;
+			heap[pos] = heap[child];
+			owners[heap[pos]].*posof = pos;
+			pos = child;
+		}
+		heap[pos] = id;
+		owners[id].*posof = pos;
+	}
+
+	// adds id to the heap, or moves it where it belongs after its key changed
+	template <typename T, typename F>
+	static void heapupdate(std::vector<uint32_t>& heap, uint32_t id, std::vector<T>& owners, uint32_t T::*posof, F first) {
+		if (owners[id].*posof == NOID) {
+			owners[id].*posof = (uint32_t)heap.size();
+			heap.push_back(id);
+		}
+		siftdown(heap, siftup(heap, owners[id].*posof, owners, posof, first), owners, posof, first);
+	}
+
+	template <typename T, typename F>
+	static void heapremove(std::vector<uint32_t>& heap, uint32_t pos, std::vector<T>& owners, uint32_t T::*posof, F first) {
+		owners[heap[pos]].*posof = NOID;
+		uint32_t last = heap.back();
+		heap.pop_back();
+		if (pos == heap.size())
+			return;
+		heap[pos] = last;
+		owners[last].*posof = pos;
+		siftdown(heap, siftup(heap, pos, owners, posof, first), owners, posof, first);
+	}
+
+	// takes the players in lobby l and the slots held for others
+	uint32_t taken(uint32_t l) const { return (uint32_t)lobbies[l].players.size() + lobbies[l].reserved; }
+
+	// whether lobby a is a better quick match than lobby b, both with a free slot:
+	// fuller share first, compared without dividing, then fewer slots left
+	bool fuller(uint32_t a, uint32_t b) const {
+		uint64_t ta = taken(a), tb = taken(b), sa = lobbies[a].slots, sb = lobbies[b].slots;
+		if (ta * sb != tb * sa)
+			return ta * sb > tb * sa;
+		if (sa - ta != sb - tb)
+			return sa - ta < sb - tb;
+		return a < b;
+	}
+
+	// whether host a should get the next lobby before host b: fewer lobbies first, counting
+	// the ones just placed so a burst of stlobs spreads out, then the shorter tick and less CPU
+	bool lighter(uint32_t a, uint32_t b) const {
+		const Load& la = hosts[a].load;
+		const Load& lb = hosts[b].load;
+		if (la.lobbies != lb.lobbies)
+			return la.lobbies < lb.lobbies;
+		if (la.tick != lb.tick)
+			return la.tick < lb.tick;
+		if (la.cpu != lb.cpu)
+			return la.cpu < lb.cpu;
+		return a < b;
+	}
+
+	// the orders of the quick match and placement heaps
+	struct Fuller {
+		const Registry* reg;
+		bool operator()(uint32_t a, uint32_t b) const { return reg->fuller(a, b); }
+	};
+	struct Lighter {
+		const Registry* reg;
+		bool operator()(uint32_t a, uint32_t b) const { return reg->lighter(a, b); }
+	};
+
+	// puts lobby l where it belongs in its region's heap after the slots it has taken changed,
+	// or out of the heap once it is full, and in the matching half of its search lists
+	void filled(uint32_t l) {
+		Lobby& lb = lobbies[l];
+		std::vector<uint32_t>& heap = regions[lb.region].joinable;
+		bool wasfull = lb.heappos == NOID;
+		if (taken(l) < lb.slots)
+			heapupdate(heap, l, lobbies, &Lobby::heappos, Fuller{ this });
+		else if (lb.heappos != NOID)
+			heapremove(heap, lb.heappos, lobbies, &Lobby::heappos, Fuller{ this });
+		bool full = lb.heappos == NOID;
+		if (full == wasfull)
+			return;
+		for (int k = 0; k < ATTRKINDS; ++k) {
+			if (lb.attrs[k] == NOID)
+				continue;
+			AttrList& list = attrlists[lb.attrs[k]];
+			attrremove(list.lobbies[wasfull], lb.attrpos[k], k);
+			lb.attrpos[k] = (uint32_t)list.lobbies[full].size();
+			list.lobbies[full].push_back(l);
+		}
+	}
+
+	// removes list[pos] as swapremove does, for position k of the search lists
+	void attrremove(std::vector<uint32_t>& list, uint32_t pos, int k) {
+		uint32_t last = list.back();
+		list[pos] = last;
+		lobbies[last].attrpos[k] = pos;
+		list.pop_back();
+	}
+
+	// takes lobby l out of its search lists, forgetting the lists it leaves empty
+	void unindex(uint32_t l) {
+		Lobby& lb = lobbies[l];
+		for (int k = 0; k < ATTRKINDS; ++k) {
+			uint32_t a = lb.attrs[k];
+			if (a == NOID)
+				continue;
+			attrremove(attrlists[a].lobbies[lb.heappos == NOID], lb.attrpos[k], k);
+			if (attrlists[a].lobbies[0].empty() && attrlists[a].lobbies[1].empty()) {
+				attrlists[a] = AttrList();
+				attrnames.release(a);
+			}
+			lb.attrs[k] = NOID;
+		}
+	}
+
+	// the mode or map search list a is for, without its kind
+	std::string_view attrvalue(uint32_t a) const {
+		return a == NOID ? std::string_view() : attrnames.name(a).substr(1);
+	}
+
+	// host name, or the ip of addr if it is empty
+	static std::string_view hostof(std::string_view name, const Endpoint& addr) {
+		if (!name.empty())
+			return name;
+		std::string_view ip = addr.str();
+		return ip.substr(0, ip.find(':'));
+	}
+
+	// gives the region of lobby l a new feed version, logging the change if it is recorded
+	void feedchange(uint32_t l, char op) {
+		const Lobby& lb = lobbies[l];
+		Region& rg = regions[lb.region];
+		uint32_t prev = rg.feed;
+		rg.feed = ++changes;
+		if (recording)
+			feedlog.push_back(LobbyChange{ op, prev, rg.feed, std::string(regionnames.name(lb.region)),
+				std::string(lobbynames.name(l)), (uint32_t)lb.players.size(), lb.slots });
+	}
+
+	uint32_t newserver(uint32_t r, const Endpoint& addr) {
+		uint32_t sv;
+		if (!freeservers.empty()) {
+			sv = freeservers.back();
+			freeservers.pop_back();
+		}
+		else {
+			sv = (uint32_t)servers.size();
+			servers.emplace_back();
+		}
+		servers[sv] = Server();
+		servers[sv].region = r;
+		servers[sv].addr = addr;
+		servers[sv].seen = netclock::now();
+		serverbyaddr[addr.key()] = sv;
+		serverexpiry.arm(sv, servers[sv].seen + serverlife);
+		return sv;
+	}
+
+	// takes open server sv off its region's and its host's open lists, and forgets the
+	// host once it has no open servers left
+	void unopen(uint32_t sv) {
+		uint32_t r = servers[sv].region, h = servers[sv].host;
+		swapremove(regions[r].open, servers[sv].pos, servers, &Server::pos);
+		swapremove(hosts[h].open, servers[sv].hostpos, servers, &Server::hostpos);
+		servers[sv].host = NOID;
+		if (hosts[h].open.empty()) {
+			heapremove(regions[r].hosts, hosts[h].heappos, hosts, &Host::heappos, Lighter{ this });
+			hosts[h] = Host();
+			hostnames.release(h);
+		}
+		else
+			heapupdate(regions[r].hosts, h, hosts, &Host::heappos, Lighter{ this });
+	}
+
+	void freeserver(uint32_t sv) {
+		if (servers[sv].host != NOID)
+			unopen(sv);
+		serverbyaddr.erase(servers[sv].addr.key());
+		serverexpiry.cancel(sv);
+		servers[sv] = Server();
+		freeservers.push_back(sv);
+	}
+
+	// forgets region r once nothing refers to it
+	void releaseregion(uint32_t r) {
+		if (regions[r].listed || !regions[r].lobbies.empty() || !regions[r].open.empty())
+			return;
+		regions[r] = Region();
+		regionnames.release(r);
+	}
+
+	NameTable regionnames;  // region -> region id
+	NameTable lobbynames;   // (region id, lobbyname) -> lobby id
+	NameTable playernames;  // SteamID -> player id
+	NameTable hostnames;    // (region id, host) -> host id
+	NameTable attrnames;    // (region id, 'm' mode, 'p' map or 'b' mode:map) -> search list id
+	std::vector<Region> regions;
+	std::vector<Lobby> lobbies;
+	std::vector<Player> players;
+	std::vector<Server> servers;
+	std::vector<Host> hosts;
+	std::vector<AttrList> attrlists;
+	mutable std::vector<uint64_t> ranked; // lobbies a sorted search found, kept so searches don't allocate
+	std::vector<uint32_t> freeservers;
+	std::unordered_map<uint64_t, uint32_t> serverbyaddr; // ip:port -> server
+	uint32_t changes = 0;   // lobby list changes so far, the source of region versions and feeds
+	bool recording = false;
+	std::vector<LobbyChange> feedlog;
+	// expiry deadlines by server and by player id, a second apart at most
+	TimerWheel serverexpiry{ std::chrono::seconds(1) };
+	TimerWheel playerexpiry{ std::chrono::seconds(1) };
+	netclock::duration serverlife = std::chrono::seconds(90);  // three of Server.cs's 30 s heartbeats
+	netclock::duration playerlife = std::chrono::seconds(600);
+	uint32_t lobbyslots = LOBBYSLOTS;
+};
@@ -0,0 +1,392 @@
+// relay.h : Relay of game traffic for players whose NAT hole punching fails.
+//
+// Every relay thread (-R port, one per worker) owns RELAYPORTS UDP sockets on
+// consecutive ports. A session joins a player's address and the address of
+// the game server of their lobby on one of these ports. A port carries any
+// number of sessions as long as no two of them share a player or a server, so
+// the port a datagram came in on and its sender find its session, and it goes
+// out of the same port to the other end. The game server sees every relayed
+// player of its lobby at a port of their own, and needs nothing else.
+//
+// A worker asks a relay thread for a session through the thread's Inbox, and
+// the relay hands the session's port and a token for each end back to the
+// worker, which answers the player with prack and tells the server srely from
+// the game port: both have sent there already, so their NATs let the answers
+// in, which a packet from a relay port they never sent to wouldn't be. Each end
+// then sends "rhelo token" to the relay port, and the session takes the address
+// that hello came from as that end's, answering "rhack token"; a symmetric NAT
+// gives that traffic another source port than the game port saw. Sessions that
+// carry nothing for RELAYIDLE are dropped.
+//
+// Datagrams are received with one recvmmsg() per ready port into buffers
+// allocated once, and sent back out of the same buffers with one sendmmsg():
+// only the address changes, so nothing is copied or allocated per datagram.
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+#include "netio.h"
+#include "protocol.h"
+#include "registry.h"
+#include "shard.h"
+
+#define RELAYPORTS 16                         // ports of a relay thread, most relayed players of one server
+#define RELAYLEN 2048                         // largest datagram relayed, longer ones are dropped
+#define RELAYIDLE std::chrono::seconds(15)    // quiet time after which a session is dropped
+#define RELAYSWEEP std::chrono::seconds(1)    // time between looks for quiet sessions
+
+// ip and port of a, the key sessions are found by
+inline uint64_t addrkey(const sockaddr_in& a) {
+	return ((uint64_t)a.sin_addr.s_addr << 16) | a.sin_port;
+}
+
+// what mstat reports of the relay threads
+struct RelayMetrics {
+	Counter packets;     // datagrams relayed
+	Counter bytes;
+	Counter unknown;     // datagrams from an address with no session on their port, or before the other end's hello
+	Counter toolong;     // datagrams longer than RELAYLEN
+	Counter opened;      // sessions made
+	Counter idled;       // sessions dropped for being quiet
+	std::atomic<uint64_t> sessions{0};
+};
+
+#ifndef _WIN32
+
+// One relay thread's ports and sessions.
+class Relay {
+public:
+	Relay() {
+		for (int k = 0; k < RELAYPORTS; ++k)
+			socks[k] = INVALID_SOCKET;
+	}
+	~Relay() { close(); }
+
+	// binds ports firstport to firstport + RELAYPORTS - 1, and watches them and the inbox
+	// workers ask for sessions through, answering them through out; false if a port can't be bound
+	bool open(unsigned short firstport, Inbox* in, Inbox* out, RelayMetrics* m, int batch) {
+		first = firstport;
+		inbox = in;
+		answers = out;
+		metrics = m;
+		batchsize = batch < 1 ? 1 : batch > MAXBATCH ? MAXBATCH : batch;
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			return false;
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		for (int k = 0; k < RELAYPORTS; ++k) {
+			socks[k] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			sockaddr_in a;
+			memset(&a, 0, sizeof(a));
+			a.sin_family = AF_INET;
+			a.sin_addr.s_addr = INADDR_ANY;
+			a.sin_port = htons((unsigned short)(firstport + k));
+			ev.data.u32 = (uint32_t)k;
+			if (socks[k] < 0 || ::bind(socks[k], (sockaddr*)&a, sizeof(a)) != 0
+				|| epoll_ctl(epfd, EPOLL_CTL_ADD, socks[k], &ev) != 0)
+				return false;
+		}
+		ev.data.u32 = RELAYPORTS;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, inbox->fd(), &ev) != 0)
+			return false;
+
+		// the pool: every receive slot points at its buffer, sends point at the same buffers
+		memset(rmsgs, 0, sizeof(rmsgs));
+		memset(smsgs, 0, sizeof(smsgs));
+		for (int i = 0; i < MAXBATCH; ++i) {
+			riovs[i].iov_base = bufs[i];
+			riovs[i].iov_len = RELAYLEN;
+			rmsgs[i].msg_hdr.msg_iov = &riovs[i];
+			rmsgs[i].msg_hdr.msg_iovlen = 1;
+			rmsgs[i].msg_hdr.msg_name = &froms[i];
+			siovs[i].iov_base = bufs[i];
+			smsgs[i].msg_hdr.msg_iov = &siovs[i];
+			smsgs[i].msg_hdr.msg_iovlen = 1;
+			smsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		}
+		nextsweep = netclock::now() + RELAYSWEEP;
+		return true;
+	}
+
+	void close() {
+		for (int k = 0; k < RELAYPORTS; ++k) {
+			if (socks[k] >= 0)
+				::close(socks[k]);
+			socks[k] = -1;
+		}
+		if (epfd >= 0)
+			::close(epfd);
+		epfd = -1;
+	}
+
+	// relays until the process ends
+	void run() {
+		epoll_event evs[RELAYPORTS + 1];
+		for (;;) {
+			netclock::time_point now = netclock::now();
+			if (now >= nextsweep)
+				sweep(now);
+			// sleep until a port is readable, a worker asks for a session, or the next sweep
+			int timeout = sessions.size() == freed.size() ? -1
+				: (int)std::chrono::duration_cast<std::chrono::milliseconds>(nextsweep - now).count() + 1;
+			if (!inbox->sleep())
+				timeout = 0;
+			int n = epoll_wait(epfd, evs, RELAYPORTS + 1, timeout);
+			for (int i = 0; i < n; ++i) {
+				if (evs[i].data.u32 == RELAYPORTS) {
+					uint64_t wakeups;
+					while (read(inbox->fd(), &wakeups, sizeof(wakeups)) > 0) {}
+				}
+				else {
+					relay((int)evs[i].data.u32);
+				}
+			}
+			takerequests();
+		}
+	}
+
+private:
+	// the player or the server of a session
+	struct End {
+		sockaddr_in addr;                // where its hello came from
+		bool bound = false;              // once it said hello
+		uint64_t asked = 0;              // addrkey of where it reached the game port from
+		uint64_t token = 0;              // what its hello carries
+	};
+	struct Session {
+		End ends[2];                     // the player's and the server's
+		int port = -1;                   // index of the port it is on, -1 if the slot is free
+		netclock::time_point heard;
+	};
+
+	// moves what waits on port k, one batch
+	void relay(int k) {
+		for (int i = 0; i < batchsize; ++i)
+			rmsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		int n = recvmmsg(socks[k], rmsgs, (unsigned)batchsize, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			return;
+		netclock::time_point now = netclock::now();
+		int out = 0;
+		uint64_t bytes = 0;
+		for (int i = 0; i < n; ++i) {
+			if (rmsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				metrics->toolong.add();
+				continue;
+			}
+			if (rmsgs[i].msg_len > 6 && memcmp(bufs[i], "rhelo ", 6) == 0) {
+				hello(k, froms[i], bufs[i], rmsgs[i].msg_len, now);
+				continue;
+			}
+			// only from an end that said hello to one that did
+			uint64_t key = addrkey(froms[i]);
+			auto it = ports[k].find(key);
+			Session* s = it == ports[k].end() ? nullptr : &sessions[it->second];
+			int end = !s ? -1 : s->ends[0].bound && addrkey(s->ends[0].addr) == key ? 0
+				: s->ends[1].bound && addrkey(s->ends[1].addr) == key ? 1 : -1;
+			if (end < 0 || !s->ends[1 - end].bound) {
+				metrics->unknown.add();
+				continue;
+			}
+			s->heard = now;
+			smsgs[out].msg_hdr.msg_name = &s->ends[1 - end].addr;
+			siovs[out].iov_base = bufs[i];
+			siovs[out].iov_len = rmsgs[i].msg_len;
+			bytes += rmsgs[i].msg_len;
+			++out;
+		}
+		for (int sent = 0; sent < out; ) {
+			int m = sendmmsg(socks[k], smsgs + sent, (unsigned)(out - sent), 0);
+			if (m < 0 && errno == EINTR)
+				continue;
+			// skip the datagram that failed, as a failed sendto() drops its one
+			sent += m < 0 ? 1 : m;
+		}
+		metrics->packets.add((uint64_t)out);
+		metrics->bytes.add(bytes);
+	}
+
+	// makes the sessions workers asked for
+	void takerequests() {
+		ShardMessage m;
+		for (int i = 0; i < 64 && inbox->pop(m); ++i) {
+			// xrely ID:region:lobby:serverip:serverport, from the player
+			Request r;
+			parserequest(m.data, m.len, r);
+			Endpoint server;
+			if (r.code != cmdcode("xrely") || !makeendpoint(r.field(3), r.field(4), server))
+				continue;
+			start(r.field(0), r.field(1), r.field(2), m.from, server.addr);
+		}
+	}
+
+	// the session of player with server, keyed on port by the addresses both reached the
+	// game port from until their hellos come; the worker answers them
+	void start(std::string_view uname, std::string_view region, std::string_view lname,
+		const sockaddr_in& player, const sockaddr_in& server) {
+		uint64_t pk = addrkey(player), sk = addrkey(server);
+		// a player asking again, or for another server, keeps one session
+		int port = -1;
+		for (int k = 0; k < RELAYPORTS && port < 0; ++k) {
+			auto it = ports[k].find(pk);
+			if (it == ports[k].end() || sessions[it->second].ends[0].asked != pk)
+				continue;
+			if (sessions[it->second].ends[1].asked == sk)
+				port = k;
+			else
+				drop(it->second);
+		}
+		for (int k = 0; k < RELAYPORTS && port < 0; ++k) {
+			if (ports[k].count(pk) == 0 && ports[k].count(sk) == 0)
+				port = k;
+		}
+		// xrack ID:region:lobby:relayport:playertoken:servertoken:serverip:serverport, a relay
+		// port of 0 if every port already has the server or the player
+		Reply t("xrack");
+		t.field(uname).field(region).field(lname);
+		if (port < 0) {
+			t.field("0");
+			if (!answers->push(player, t.data(), t.size(), true))
+				metrics->unknown.add();
+			return;
+		}
+		if (ports[port].count(pk) == 0) {
+			uint32_t id;
+			if (!freed.empty()) {
+				id = freed.back();
+				freed.pop_back();
+			}
+			else {
+				id = (uint32_t)sessions.size();
+				sessions.emplace_back();
+			}
+			Session& s = sessions[id];
+			s.port = port;
+			for (int end = 0; end < 2; ++end) {
+				s.ends[end] = End();
+				s.ends[end].asked = end == 0 ? pk : sk;
+				// a token no other session holds, 0 is never one
+				do
+					s.ends[end].token = rng();
+				while (s.ends[end].token == 0 || tokens.count(s.ends[end].token) != 0);
+				tokens[s.ends[end].token] = id * 2 + end;
+			}
+			ports[port][pk] = id;
+			ports[port][sk] = id;
+			metrics->opened.add();
+			metrics->sessions.fetch_add(1, std::memory_order_relaxed);
+		}
+		Session& s = sessions[ports[port][pk]];
+		s.heard = netclock::now();
+		t.field(std::to_string(first + port)).field(std::to_string(s.ends[0].token)).field(std::to_string(s.ends[1].token))
+			.field(makeendpoint(server).str());
+		if (!answers->push(player, t.data(), t.size(), true))
+			metrics->unknown.add();
+	}
+
+	// rhelo token, from an end of a session on port k: its datagrams come from there now
+	void hello(int k, const sockaddr_in& from, const char* data, size_t len, netclock::time_point now) {
+		uint64_t token = 0;
+		for (size_t i = 6; i < len && data[i] >= '0' && data[i] <= '9'; ++i)
+			token = token * 10 + (uint64_t)(data[i] - '0');
+		auto t = tokens.find(token);
+		if (t == tokens.end() || sessions[t->second / 2].port != k) {
+			metrics->unknown.add();
+			return;
+		}
+		uint32_t id = t->second / 2;
+		Session& s = sessions[id];
+		End& e = s.ends[t->second % 2];
+		uint64_t key = addrkey(from);
+		// the address is another session's on this port
+		auto it = ports[k].find(key);
+		if (it != ports[k].end() && it->second != id) {
+			metrics->unknown.add();
+			return;
+		}
+		// an end whose NAT moved it says hello again from its new address
+		if (e.bound && addrkey(e.addr) != key) {
+			uint64_t old = addrkey(e.addr);
+			if (old != s.ends[0].asked && old != s.ends[1].asked)
+				ports[k].erase(old);
+		}
+		e.addr = from;
+		e.bound = true;
+		ports[k][key] = id;
+		s.heard = now;
+		std::string ack = "rhack " + std::to_string(token);
+		sendto(socks[k], ack.data(), ack.size(), 0, (const sockaddr*)&from, sizeof(from));
+	}
+
+	void drop(uint32_t id) {
+		Session& s = sessions[id];
+		for (const End& e : s.ends) {
+			ports[s.port].erase(e.asked);
+			if (e.bound)
+				ports[s.port].erase(addrkey(e.addr));
+			tokens.erase(e.token);
+		}
+		s.port = -1;
+		freed.push_back(id);
+		metrics->sessions.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// drops the sessions quiet for RELAYIDLE
+	void sweep(netclock::time_point now) {
+		for (uint32_t id = 0; id < sessions.size(); ++id) {
+			if (sessions[id].port >= 0 && now - sessions[id].heard >= RELAYIDLE) {
+				drop(id);
+				metrics->idled.add();
+			}
+		}
+		nextsweep = now + RELAYSWEEP;
+	}
+
+	unsigned short first = 0;        // port of socks[0]
+	Inbox* inbox = nullptr;
+	Inbox* answers = nullptr;        // of the worker, for the sessions made
+	RelayMetrics* metrics = nullptr;
+	int batchsize = MAXBATCH;
+	int epfd = -1;
+	SOCKET socks[RELAYPORTS];
+	// the sessions of each port, by the addresses either end reached the game port and
+	// said hello from
+	std::unordered_map<uint64_t, uint32_t> ports[RELAYPORTS];
+	// session * 2 + end by the token of the end's hello, tokens are random so nobody
+	// else can take an end's place
+	std::unordered_map<uint64_t, uint32_t> tokens;
+	std::mt19937_64 rng{ std::random_device{}() };
+	std::vector<Session> sessions;
+	std::vector<uint32_t> freed;     // free slots of sessions
+	netclock::time_point nextsweep;
+
+	// the buffer pool
+	char bufs[MAXBATCH][RELAYLEN];
+	sockaddr_in froms[MAXBATCH];
+	mmsghdr rmsgs[MAXBATCH];
+	iovec riovs[MAXBATCH];
+	mmsghdr smsgs[MAXBATCH];
+	iovec siovs[MAXBATCH];
+};
+
+#else
+
+// the relay needs recvmmsg() and epoll, on Windows the masterserver runs without one
+class Relay {
+public:
+	bool open(unsigned short, Inbox*, Inbox*, RelayMetrics*, int) { return false; }
+	void close() {}
+	void run() {}
+};
+
+#endif
@@ -0,0 +1,311 @@
+// replica.h : Hot standby, a second masterserver that follows the registry of
+// the first one and takes over its port when it stops.
+//
+// The primary (-r port) streams every record its workers journal, framed as
+// persist.h writes them, to one standby (-f host:port) over TCP. Every worker
+// has its own stream: worker w listens on port + w, and the standby's worker
+// w, which has to run with as many workers, connects to it. A stream starts
+// with a header and the worker's whole registry as a wipe and a snapshot, then
+// carries the records as they are made, sent once per loop turn. The snapshot
+// is built a few regions per loop turn as the journal's is, once the standby
+// took what was sent before, so a big registry doesn't stall the worker; the
+// records made meanwhile go out between its parts, which is fine since every
+// record sets what it records. A beat ends the snapshot, and a primary with
+// nothing to send sends one every REPLBEAT.
+//
+// The standby applies the records in order and serves nothing. Once it has
+// been in sync, a primary that sends nothing for REPLTIMEOUT (and doesn't take
+// a new connection) is taken for dead: the standby's workers stop following,
+// bind the game port, retrying while the old primary still holds it, and serve
+// the registry they followed, so a failover takes about REPLTIMEOUT. Workers
+// sharing the port with SO_REUSEPORT first take a name for it that only one
+// process can hold (see fenceport()), so a standby on the same machine can't
+// join the primary's workers on the port while the primary lives.
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "netio.h"
+#include "persist.h"
+#include "registry.h"
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#include <poll.h>
+#endif
+
+#define REPLBEAT std::chrono::milliseconds(250)     // most time a primary's stream stays quiet
+#define REPLTIMEOUT std::chrono::milliseconds(1000) // quiet time after which the standby takes over
+#define REPLBACKLOG (64u << 20)                     // unsent bytes after which a slow standby is dropped
+#define REPLRETRY std::chrono::milliseconds(1)      // wait for a standby to take a snapshot part
+
+#ifndef _WIN32
+
+// The stream of one primary worker to its standby.
+class Standby {
+public:
+	~Standby() { close(); }
+
+	// listens for the standby's worker on port, false if the port can't be bound
+	bool listen(unsigned short port, int s, int w) {
+		shard = s;
+		workers = w;
+		lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (lfd < 0)
+			return false;
+		int one = 1;
+		setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in a;
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = INADDR_ANY;
+		a.sin_port = htons(port);
+		if (::bind(lfd, (sockaddr*)&a, sizeof(a)) != 0 || ::listen(lfd, 1) != 0) {
+			::close(lfd);
+			lfd = -1;
+			return false;
+		}
+		return true;
+	}
+
+	void close() {
+		drop();
+		if (lfd >= 0)
+			::close(lfd);
+		lfd = -1;
+	}
+
+	bool enabled() const { return lfd >= 0; }
+	bool connected() const { return fd >= 0; }
+
+	// queues a record for the standby, sent by the next flush()
+	void log(char type, std::initializer_list<std::string_view> fields) {
+		if (fd < 0)
+			return;
+		appendrecord(pending, type, fields);
+	}
+
+	// takes a standby that connected, starting its stream with a snapshot of reg built a step
+	// at a time, and sends what is queued, or a beat if nothing was sent for REPLBEAT; true once
+	// a standby got the whole snapshot
+	bool flush(const Registry& reg) {
+		if (lfd < 0)
+			return false;
+		int c = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (c >= 0) {
+			// a new connection is a standby that restarted or lost the old one
+			drop();
+			fd = c;
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			JournalHeader h;
+			h.snapshot = 1;
+			h.shard = (uint32_t)shard;
+			h.workers = (uint32_t)workers;
+			pending.assign((const char*)&h, sizeof(h));
+			appendrecord(pending, REC_WIPE, {});
+			builder.start();
+			building = true;
+		}
+		netclock::time_point now = netclock::now();
+		if (fd < 0) {
+			lastsend = now;
+			return false;
+		}
+		// the next part of the snapshot once the last one went out, and the beat
+		// that tells the standby it has all of it
+		bool built = false;
+		if (building && pending.size() - sent < SNAPSHOTSTEP && builder.next(reg, pending, SNAPSHOTSTEP)) {
+			appendrecord(pending, REC_BEAT, {});
+			building = false;
+			built = true;
+		}
+		if (!building && pending.size() == sent && now - lastsend >= REPLBEAT)
+			appendrecord(pending, REC_BEAT, {});
+		while (sent < pending.size()) {
+			ssize_t k = ::send(fd, pending.data() + sent, pending.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (k <= 0) {
+				drop();
+				return false;
+			}
+			sent += (size_t)k;
+			lastsend = now;
+		}
+		if (sent == pending.size()) {
+			pending.clear();
+			sent = 0;
+		}
+		// a standby that can't keep up starts over with a snapshot when it reconnects
+		else if (pending.size() - sent > REPLBACKLOG)
+			drop();
+		// what was sent of a long stream isn't kept until all of it is
+		else if (sent >= 4 * SNAPSHOTSTEP) {
+			pending.erase(0, sent);
+			sent = 0;
+		}
+		return built;
+	}
+
+	// whether the next part of a snapshot can be built now, the worker shouldn't sleep
+	bool busy() const { return building && pending.size() - sent < SNAPSHOTSTEP; }
+
+	// when flush() should next run to beat, look for a standby or go on with a snapshot the
+	// standby is slow to take, false without -r
+	bool nextbeat(netclock::time_point& when) const {
+		if (lfd < 0)
+			return false;
+		when = building ? netclock::now() + REPLRETRY : lastsend + REPLBEAT;
+		return true;
+	}
+
+private:
+	void drop() {
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+		pending.clear();
+		sent = 0;
+		building = false;
+	}
+
+	int shard = 0;
+	int workers = 1;
+	int lfd = -1;
+	int fd = -1;
+	std::string pending;          // records not sent yet, from sent on
+	size_t sent = 0;
+	SnapshotBuilder builder;      // the snapshot the standby is being sent
+	bool building = false;
+	netclock::time_point lastsend; // or looked for a standby, while there is none
+};
+
+// The stream a standby worker follows from its primary.
+class Primary {
+public:
+	~Primary() { close(); }
+
+	void close() {
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+		buf.clear();
+		header = false;
+	}
+
+	bool connected() const { return fd >= 0; }
+	// whether a whole snapshot was applied since the standby started
+	bool synced() const { return insync; }
+	// whether the primary runs with another number of workers, the standby can't follow it
+	bool mismatched() const { return mismatch; }
+	// when the last record came
+	netclock::time_point heard() const { return lastheard; }
+
+	// connects to the primary's worker at a, false if it isn't there or doesn't answer in wait
+	bool connect(const sockaddr_in& a, std::chrono::milliseconds wait) {
+		close();
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return false;
+		if (::connect(fd, (const sockaddr*)&a, sizeof(a)) != 0) {
+			pollfd p;
+			p.fd = fd;
+			p.events = POLLOUT;
+			p.revents = 0;
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (errno != EINPROGRESS || poll(&p, 1, (int)wait.count()) <= 0
+				|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+				close();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// waits up to wait for the stream and applies the records that came to reg, which has to
+	// be shard out of workers; false if the connection closed or its header doesn't match
+	bool follow(Registry& reg, int shard, int workers, std::chrono::milliseconds wait) {
+		pollfd p;
+		p.fd = fd;
+		p.events = POLLIN;
+		p.revents = 0;
+		if (poll(&p, 1, (int)wait.count()) <= 0)
+			return true;
+		char chunk[65536];
+		ssize_t k = ::recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+		if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return true;
+		if (k <= 0) {
+			close();
+			return false;
+		}
+		buf.append(chunk, (size_t)k);
+		const char* q = buf.data();
+		const char* end = q + buf.size();
+		if (!header) {
+			if (buf.size() < sizeof(JournalHeader))
+				return true;
+			JournalHeader h;
+			memcpy(&h, q, sizeof(h));
+			if (h.magic != JOURNALMAGIC || h.shard != (uint32_t)shard || h.workers != (uint32_t)workers) {
+				mismatch = true;
+				close();
+				return false;
+			}
+			q += sizeof(h);
+			header = true;
+		}
+		// the hint points into buf, so it only lasts for this chunk
+		JournalRecord rec;
+		ReplayHint hint;
+		while (nextrecord(q, end, rec)) {
+			lastheard = netclock::now();
+			if (rec.type == REC_BEAT)
+				insync = true;
+			else
+				applyrecord(reg, rec, hint);
+		}
+		buf.erase(0, (size_t)(q - buf.data()));
+		return true;
+	}
+
+private:
+	int fd = -1;
+	std::string buf;              // bytes received and not applied yet, a record cut short
+	bool header = false;          // the stream's header was checked
+	bool insync = false;
+	bool mismatch = false;
+	netclock::time_point lastheard;
+};
+
+#else
+
+// a standby needs poll() and accept4(), on Windows the masterserver runs without one
+class Standby {
+public:
+	bool listen(unsigned short, int, int) { return false; }
+	void close() {}
+	bool enabled() const { return false; }
+	bool connected() const { return false; }
+	void log(char, std::initializer_list<std::string_view>) {}
+	bool flush(const Registry&) { return false; }
+	bool busy() const { return false; }
+	bool nextbeat(netclock::time_point&) const { return false; }
+};
+class Primary {
+public:
+	void close() {}
+	bool connected() const { return false; }
+	bool synced() const { return false; }
+	bool mismatched() const { return false; }
+	netclock::time_point heard() const { return netclock::time_point(); }
+	bool connect(const sockaddr_in&, std::chrono::milliseconds) { return false; }
+	bool follow(Registry&, int, int, std::chrono::milliseconds) { return false; }
+};
+
+#endif
@@ -0,0 +1,176 @@
+// shard.h : Pieces used to run the masterserver as several worker threads.
+//
+// Every worker binds its own socket to the same port (SO_REUSEPORT) and owns
+// a private shard of the registry. Regions, and the lobbies in them, belong
+// to the worker shardof(region) picks; players' addresses and invites belong
+// to the worker shardof(SteamID) picks. A worker that receives a packet for
+// another worker's shard hands it over through that worker's Inbox, a
+// bounded lock-free queue that many workers push to and only its owner pops.
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "netio.h"
+#ifndef _WIN32
+#include <sys/eventfd.h>
+#endif
+
+#define MAXSHARDS 64     // most workers the masterserver runs
+#define SHARDMSGLEN 1024 // largest packet handed between workers, the receive buffer size
+
+// 64-bit hash of a key (a region or a SteamID), FNV-1a with its bits mixed
+inline uint64_t keyhash(std::string_view key) {
+	uint64_t h = 14695981039346656037ull;
+	for (char c : key) { h ^= (unsigned char)c; h *= 1099511628211ull; }
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+// worker that owns key out of n
+inline int shardof(std::string_view key, int n) {
+	if (n <= 1)
+		return 0;
+	return (int)(keyhash(key) % (uint64_t)n);
+}
+
+// a packet handed from one worker to another
+struct ShardMessage {
+	sockaddr_in from;       // who sent the packet to the masterserver
+	uint16_t len;
+	bool internal;          // sent by a worker, not received from the network
+	char data[SHARDMSGLEN];
+};
+
+// Bounded multi-producer single-consumer queue of ShardMessages (Vyukov's
+// bounded queue: every cell has a sequence number that says whether it is
+// free for the producer holding that position or full for the consumer).
+// The consumer sleeps in its EventLoop; producers wake it through an
+// eventfd, but only when it said it was going to sleep.
+class Inbox {
+public:
+	explicit Inbox(size_t capacity = 1024) {
+		size_t n = 2;
+		while (n < capacity)
+			n <<= 1;
+		cells.reset(new Cell[n]);
+		mask = n - 1;
+		for (size_t i = 0; i < n; ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+#ifndef _WIN32
+		wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	}
+	~Inbox() {
+#ifndef _WIN32
+		if (wakefd >= 0)
+			::close(wakefd);
+#endif
+	}
+
+	// copies a packet into the queue, false if it is full
+	// any thread may push
+	bool push(const sockaddr_in& from, const char* data, size_t len, bool internal) {
+		if (len > SHARDMSGLEN)
+			return false;
+		size_t pos = tail.load(std::memory_order_relaxed);
+		Cell* c;
+		for (;;) {
+			c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		c->msg.from = from;
+		c->msg.len = (uint16_t)len;
+		c->msg.internal = internal;
+		memcpy(c->msg.data, data, len);
+		c->seq.store(pos + 1, std::memory_order_release);
+		// wake the owner if it is about to sleep or sleeping
+		if (sleeping.exchange(false))
+			wake();
+		return true;
+	}
+
+	// takes the oldest packet, false if there is none
+	// only the owning worker may pop
+	bool pop(ShardMessage& m) {
+		Cell& c = cells[head & mask];
+		size_t seq = c.seq.load(std::memory_order_acquire);
+		if ((intptr_t)seq - (intptr_t)(head + 1) < 0)
+			return false;
+		m.from = c.msg.from;
+		m.len = c.msg.len;
+		m.internal = c.msg.internal;
+		memcpy(m.data, c.msg.data, m.len);
+		c.seq.store(head + mask + 1, std::memory_order_release);
+		++head;
+		return true;
+	}
+
+	// called by the owner before sleeping, returns false if packets arrived
+	// in the meantime and it should not sleep
+	bool sleep() {
+		sleeping.store(true);
+		Cell& c = cells[head & mask];
+		if ((intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)(head + 1) >= 0) {
+			sleeping.store(false);
+			return false;
+		}
+		return true;
+	}
+
+	// fd the owner's EventLoop watches, -1 where there is none
+	int fd() const { return wakefd; }
+	// packets lost because the queue was full
+	uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+	struct Cell {
+		std::atomic<size_t> seq;
+		ShardMessage msg;
+	};
+
+	void wake() {
+#ifndef _WIN32
+		uint64_t one = 1;
+		if (write(wakefd, &one, sizeof(one)) < 0) {}
+#endif
+	}
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> tail{0}; // next position producers claim
+	alignas(64) size_t head = 0;             // next position the owner pops
+	std::atomic<bool> sleeping{false};
+	std::atomic<uint64_t> dropped{0};
+	int wakefd = -1;
+};
+
+// Text each worker publishes for the others to read, e.g. the regions it
+// lists. Readers get a snapshot; a writer replaces it without blocking them.
+class SharedText {
+public:
+	SharedText() : text(std::make_shared<const std::string>()) {}
+	void publish(std::string t) {
+		std::atomic_store(&text, std::shared_ptr<const std::string>(std::make_shared<const std::string>(std::move(t))));
+	}
+	std::shared_ptr<const std::string> get() const { return std::atomic_load(&text); }
+
+private:
+	std::shared_ptr<const std::string> text;
+};
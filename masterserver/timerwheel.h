@@ -0,0 +1,250 @@
+// timerwheel.h : Hierarchical timer wheel used to schedule retransmissions.
+//
+// Timers are identified by a small integer id chosen by the caller (the
+// unACKed packet slot). Arming, cancelling and expiring a timer are O(1);
+// advancing the wheel only touches the slots that come due, so the cost of
+// a tick follows the number of expiring timers, not the number outstanding.
+//
+// Layout follows the classic kernel wheel: 256 one-tick slots, then three
+// levels of 64 slots that are cascaded down as time reaches them. With the
+// default 1ms tick the wheel covers about 18 hours; anything further out is
+// clamped to the last slot and re-cascaded.
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "netio.h"
+
+class TimerWheel {
+public:
+	static constexpr uint32_t NIL = 0xffffffff;
+
+	explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(1))
+		: tickms(tick), base(netclock::now()) {
+		heads.assign(ROOTSLOTS + LEVELS * LEVELSLOTS, NIL);
+		for (int l = 0; l <= LEVELS; ++l)
+			levelcount[l] = 0;
+	}
+
+	// (re)arm timer id to expire at deadline
+	void arm(uint32_t id, netclock::time_point deadline) {
+		if (id >= nodes.size())
+			nodes.resize(id + 1);
+		if (nodes[id].armed)
+			unlink(id);
+		nodes[id].expires = tickof(deadline);
+		insert(id);
+	}
+
+	// stop timer id from firing, does nothing if it isn't armed
+	void cancel(uint32_t id) {
+		if (id < nodes.size() && nodes[id].armed)
+			unlink(id);
+	}
+
+	bool armed(uint32_t id) const {
+		return id < nodes.size() && nodes[id].armed;
+	}
+
+	// number of armed timers
+	size_t size() const { return count; }
+
+	// cancel every timer
+	void clear() {
+		heads.assign(heads.size(), NIL);
+		nodes.clear();
+		for (int l = 0; l <= LEVELS; ++l)
+			levelcount[l] = 0;
+		count = 0;
+	}
+
+	// fire every timer whose deadline is at or before now, calling fire(id)
+	// fire may arm or cancel any timer, including the one being fired
+	template <typename F>
+	void advance(netclock::time_point now, F fire) {
+		uint64_t target = tickfloor(now);
+		running = true;
+		while (current <= target) {
+			if (count == 0) {
+				current = target + 1;
+				break;
+			}
+			// lowest level is empty, skip ahead to the next cascade point
+			if (levelcount[0] == 0) {
+				uint64_t next = (current | ROOTMASK) + 1;
+				if (next > target) {
+					if ((current = target + 1) == next)
+						cascadeall();
+					break;
+				}
+				current = next;
+				cascadeall();
+				continue;
+			}
+			uint32_t& head = heads[current & ROOTMASK];
+			while (head != NIL) {
+				uint32_t id = head;
+				unlink(id);
+				fire(id);
+			}
+			// upper levels are cascaded as soon as current reaches their slot
+			if ((++current & ROOTMASK) == 0)
+				cascadeall();
+		}
+		running = false;
+	}
+
+	// earliest time advance() may have work to do, false if nothing is armed
+	// (for timers on the upper levels this is when they cascade down)
+	bool nextexpiry(netclock::time_point& when) const {
+		if (count == 0)
+			return false;
+		uint64_t best = UINT64_MAX;
+		if (levelcount[0] > 0) {
+			for (uint32_t k = 0; k < ROOTSLOTS; ++k) {
+				if (heads[(current + k) & ROOTMASK] != NIL) {
+					best = current + k;
+					break;
+				}
+			}
+		}
+		// level 0 can hold timers past the next cascade, so every level is checked
+		for (int l = 1; l <= LEVELS; ++l) {
+			if (levelcount[l] == 0)
+				continue;
+			int shift = ROOTBITS + (l - 1) * LEVELBITS;
+			uint64_t window = current >> shift;
+			for (uint32_t k = 1; k <= LEVELSLOTS; ++k) {
+				if (heads[slotindex(l, (window + k) & LEVELMASK)] != NIL) {
+					if (((window + k) << shift) < best)
+						best = (window + k) << shift;
+					break;
+				}
+			}
+		}
+		if (best < current)
+			best = current;
+		when = base + tickms * (int64_t)best;
+		return true;
+	}
+
+private:
+	static constexpr int ROOTBITS = 8;
+	static constexpr int LEVELBITS = 6;
+	static constexpr int LEVELS = 3;
+	static constexpr uint32_t ROOTSLOTS = 1 << ROOTBITS;
+	static constexpr uint32_t LEVELSLOTS = 1 << LEVELBITS;
+	static constexpr uint64_t ROOTMASK = ROOTSLOTS - 1;
+	static constexpr uint64_t LEVELMASK = LEVELSLOTS - 1;
+	static constexpr uint64_t MAXDELTA = (1ull << (ROOTBITS + LEVELS * LEVELBITS)) - 1;
+
+	struct Node {
+		uint32_t prev = NIL;
+		uint32_t next = NIL;
+		uint32_t slot = NIL; // index into heads
+		uint64_t expires = 0;
+		bool armed = false;
+	};
+
+	static uint32_t slotindex(int level, uint64_t i) {
+		return level == 0 ? (uint32_t)i : ROOTSLOTS + (level - 1) * LEVELSLOTS + (uint32_t)i;
+	}
+
+	static int levelof(uint32_t slot) {
+		return slot < ROOTSLOTS ? 0 : 1 + (slot - ROOTSLOTS) / LEVELSLOTS;
+	}
+
+	// first tick at or after t
+	uint64_t tickof(netclock::time_point t) const {
+		if (t <= base)
+			return 0;
+		auto d = t - base;
+		uint64_t ticks = (uint64_t)(d / tickms);
+		if (tickms * ticks < d)
+			++ticks;
+		return ticks;
+	}
+
+	// last tick at or before t
+	uint64_t tickfloor(netclock::time_point t) const {
+		if (t <= base)
+			return 0;
+		return (uint64_t)((t - base) / tickms);
+	}
+
+	void insert(uint32_t id) {
+		Node& n = nodes[id];
+		uint64_t floor = running ? current + 1 : current;
+		if (n.expires < floor)
+			n.expires = floor;
+		uint64_t delta = n.expires - current;
+		if (delta > MAXDELTA) {
+			n.expires = current + MAXDELTA;
+			delta = MAXDELTA;
+		}
+		uint32_t slot;
+		if (delta < ROOTSLOTS) {
+			slot = slotindex(0, n.expires & ROOTMASK);
+		}
+		else {
+			int l = 1;
+			while (l < LEVELS && delta >= (1ull << (ROOTBITS + l * LEVELBITS)))
+				++l;
+			int shift = ROOTBITS + (l - 1) * LEVELBITS;
+			slot = slotindex(l, (n.expires >> shift) & LEVELMASK);
+		}
+		n.slot = slot;
+		n.prev = NIL;
+		n.next = heads[slot];
+		if (n.next != NIL)
+			nodes[n.next].prev = id;
+		heads[slot] = id;
+		n.armed = true;
+		++levelcount[levelof(slot)];
+		++count;
+	}
+
+	void unlink(uint32_t id) {
+		Node& n = nodes[id];
+		if (n.prev != NIL)
+			nodes[n.prev].next = n.next;
+		else
+			heads[n.slot] = n.next;
+		if (n.next != NIL)
+			nodes[n.next].prev = n.prev;
+		--levelcount[levelof(n.slot)];
+		--count;
+		n.prev = n.next = n.slot = NIL;
+		n.armed = false;
+	}
+
+	// move the upper level slots that current has reached down a level
+	void cascadeall() {
+		bool wasrunning = running;
+		running = false;
+		for (int l = 1; l <= LEVELS; ++l) {
+			int shift = ROOTBITS + (l - 1) * LEVELBITS;
+			uint64_t i = (current >> shift) & LEVELMASK;
+			uint32_t& head = heads[slotindex(l, i)];
+			while (head != NIL) {
+				uint32_t id = head;
+				unlink(id);
+				insert(id);
+			}
+			// only continue upward when this level wrapped too
+			if (i != 0)
+				break;
+		}
+		running = wasrunning;
+	}
+
+	std::chrono::milliseconds tickms;
+	netclock::time_point base;
+	uint64_t current = 0;      // next tick to be processed
+	bool running = false;      // inside advance(), new timers go to current + 1
+	size_t count = 0;
+	size_t levelcount[LEVELS + 1];
+	std::vector<uint32_t> heads;
+	std::vector<Node> nodes;
+};
@@ -0,0 +1,213 @@
+// txtable.h : Table of in-flight (unACKed) transactions with a hash index.
+//
+// Entries live in reusable slots so other structures (the retransmission
+// timer wheel) can refer to them by index. A second, open-addressed table
+// maps (command, canonical arguments) to the slot, so duplicate suppression
+// and ACK matching are single lookups instead of scans over every entry.
+//
+// T must have string members `command` and `arguments`; they form the key.
+// Keys are unique: inserting a key that is already in flight returns the
+// existing slot.
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// occupancy and collision counters, for sizing the table
+struct TxStats {
+	size_t entries = 0;        // transactions in flight
+	size_t slots = 0;          // entry slots allocated (high water mark)
+	size_t buckets = 0;        // hash index size
+	size_t maxprobe = 0;       // longest probe sequence seen by an insert or lookup
+	uint64_t lookups = 0;      // finds and inserts
+	uint64_t probes = 0;       // buckets inspected by those lookups
+	uint64_t collisions = 0;   // inserts whose home bucket was taken
+	uint64_t rehashes = 0;     // times the index grew
+	double loadfactor() const { return buckets ? (double)entries / buckets : 0; }
+	double avgprobe() const { return lookups ? (double)probes / lookups : 0; }
+};
+
+// arguments with trailing separators and line endings removed, so
+// "US:lobby1:" and "US:lobby1\n" match the same transaction
+inline std::string_view canonicalargs(std::string_view args) {
+	while (!args.empty()) {
+		char c = args.back();
+		if (c != ':' && c != '\r' && c != '\n' && c != ' ' && c != '\0')
+			break;
+		args.remove_suffix(1);
+	}
+	return args;
+}
+
+template <typename T>
+class TxTable {
+public:
+	explicit TxTable(size_t buckets = 1024) {
+		size_t n = 16;
+		while (n < buckets)
+			n <<= 1;
+		index.assign(n, Bucket());
+		st.buckets = n;
+	}
+
+	// adds a transaction, returns its slot (the existing one if the key is already in flight)
+	int insert(const T& value) {
+		std::string_view args = canonicalargs(value.arguments);
+		uint64_t h = hash(value.command, args);
+		int found = lookup(value.command, args, h);
+		if (found >= 0)
+			return found;
+		// linear probing stays short below half full
+		if ((st.entries + 1) * 2 > index.size())
+			grow();
+
+		int i;
+		if (!freeslots.empty()) {
+			i = freeslots.back();
+			freeslots.pop_back();
+			entries[i].value = value;
+		}
+		else {
+			i = (int)entries.size();
+			entries.push_back(Entry());
+			entries[i].value = value;
+		}
+		entries[i].hash = h;
+		entries[i].inuse = true;
+		place(h, i, true);
+		++st.entries;
+		st.slots = entries.size();
+		return i;
+	}
+
+	// slot of the transaction with this key, or -1
+	int find(std::string_view command, std::string_view args) {
+		args = canonicalargs(args);
+		return lookup(command, args, hash(command, args));
+	}
+
+	// removes the transaction in slot i
+	void erase(int i) {
+		if (i < 0 || i >= (int)entries.size() || !entries[i].inuse)
+			return;
+		size_t mask = index.size() - 1;
+		size_t b = entries[i].hash & mask;
+		while (index[b].slot != i)
+			b = (b + 1) & mask;
+		// backward shift deletion keeps probe sequences short without tombstones:
+		// pull later entries of the cluster into the hole unless their home
+		// bucket lies cyclically in (hole, entry]
+		size_t next = b;
+		for (;;) {
+			next = (next + 1) & mask;
+			if (index[next].slot < 0)
+				break;
+			size_t home = index[next].hash & mask;
+			bool stays = b <= next ? (b < home && home <= next) : (b < home || home <= next);
+			if (stays)
+				continue;
+			index[b] = index[next];
+			b = next;
+		}
+		index[b] = Bucket();
+		entries[i].inuse = false;
+		entries[i].value = T();
+		freeslots.push_back(i);
+		--st.entries;
+	}
+
+	void clear() {
+		entries.clear();
+		freeslots.clear();
+		index.assign(index.size(), Bucket());
+		st.entries = 0;
+		st.slots = 0;
+	}
+
+	T& operator[](int i) { return entries[i].value; }
+	const T& operator[](int i) const { return entries[i].value; }
+	bool inuse(int i) const { return i >= 0 && i < (int)entries.size() && entries[i].inuse; }
+	// number of slots, iterate 0..slots()-1 and skip the ones not inuse()
+	int slots() const { return (int)entries.size(); }
+	size_t size() const { return st.entries; }
+	const TxStats& stats() const { return st; }
+
+private:
+	struct Entry {
+		T value;
+		uint64_t hash = 0;
+		bool inuse = false;
+	};
+	struct Bucket {
+		uint64_t hash = 0;
+		int slot = -1;
+	};
+
+	// FNV-1a over command, a separator, then the arguments, with a final
+	// mix so the low bits used for the bucket depend on every byte
+	static uint64_t hash(std::string_view command, std::string_view args) {
+		uint64_t h = 14695981039346656037ull;
+		for (char c : command) { h ^= (unsigned char)c; h *= 1099511628211ull; }
+		h ^= 0xff; h *= 1099511628211ull;
+		for (char c : args) { h ^= (unsigned char)c; h *= 1099511628211ull; }
+		h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	int lookup(std::string_view command, std::string_view args, uint64_t h) {
+		size_t mask = index.size() - 1;
+		size_t b = h & mask;
+		size_t probe = 1;
+		++st.lookups;
+		for (;; b = (b + 1) & mask, ++probe) {
+			const Bucket& k = index[b];
+			if (k.slot < 0)
+				break;
+			if (k.hash == h) {
+				const T& v = entries[k.slot].value;
+				if (v.command == command && canonicalargs(v.arguments) == args) {
+					account(probe);
+					return k.slot;
+				}
+			}
+		}
+		account(probe);
+		return -1;
+	}
+
+	// puts slot i into the index at the first free bucket for hash h
+	void place(uint64_t h, int i, bool count) {
+		size_t mask = index.size() - 1;
+		size_t b = h & mask;
+		if (count && index[b].slot >= 0)
+			++st.collisions;
+		while (index[b].slot >= 0)
+			b = (b + 1) & mask;
+		index[b].hash = h;
+		index[b].slot = i;
+	}
+
+	void grow() {
+		index.assign(index.size() * 2, Bucket());
+		st.buckets = index.size();
+		++st.rehashes;
+		for (int i = 0; i < (int)entries.size(); ++i)
+			if (entries[i].inuse)
+				place(entries[i].hash, i, false);
+	}
+
+	void account(size_t probe) {
+		st.probes += probe;
+		if (probe > st.maxprobe)
+			st.maxprobe = probe;
+	}
+
+	std::vector<Entry> entries;
+	std::vector<int> freeslots;
+	std::vector<Bucket> index;
+	TxStats st;
+};